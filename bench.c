@@ -0,0 +1,390 @@
+// clang-format off
+#include <stdio.h>
+#include <gmp.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "numtheory.h"
+#include "randstate.h"
+#include "rsa.h"
+// clang-format on
+
+#define OPTIONS "hs:r:b:l:t:"
+
+#define ITERS 50 // miller-rabin iterations, as used by keygen
+
+// the original bit-at-a-time pow_mod, kept as the baseline to compare against
+static void pow_mod_ref(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
+  mpz_t v, p, dcopy;
+  mpz_init_set_ui(v, 1); // set v = 1
+  mpz_init_set(p, a);    // set p = a
+  mpz_init_set(dcopy, d);
+  while (mpz_cmp_ui(dcopy, 0) > 0) { // while d > 0
+    if (mpz_odd_p(dcopy) != 0) {     // if d is odd
+      mpz_mul(v, v, p);              // v = (v x p)
+      mpz_mod(v, v, n);              // v = v mod n
+    }
+    mpz_mul(p, p, p);               // p = (p x p)
+    mpz_mod(p, p, n);               // p = p mod n
+    mpz_fdiv_q_ui(dcopy, dcopy, 2); // d = d/2
+  }
+  mpz_set(o, v);                 // o = v
+  mpz_clears(v, p, dcopy, NULL); // clear used mpzs
+}
+
+// the original euclidean gcd, kept as the baseline to compare against
+static void gcd_ref(mpz_t d, mpz_t a, mpz_t b) {
+  mpz_t r1, r2, t;
+  mpz_init_set(r1, a);
+  mpz_init_set(r2, b);
+  mpz_init(t);
+  while (mpz_cmp_ui(r2, 0) != 0) {
+    mpz_mod(t, r1, r2); // t = a mod b
+    mpz_swap(r1, r2);   // a = b
+    mpz_swap(r2, t);    // b = t
+  }
+  mpz_set(d, r1);
+  mpz_clears(r1, r2, t, NULL);
+}
+
+// the original extended euclidean inverse, kept as the baseline to compare
+// against
+static void mod_inverse_ref(mpz_t o, mpz_t a, mpz_t n) {
+  mpz_t r1, r2, t1, t2, q, tmp;
+  mpz_inits(q, tmp, NULL);
+  mpz_init_set(r1, n);
+  mpz_init_set(r2, a);
+  mpz_init_set_ui(t1, 0);
+  mpz_init_set_ui(t2, 1);
+  while (mpz_cmp_ui(r2, 0) != 0) {
+    mpz_fdiv_qr(q, tmp, r1, r2); // q = r1/r2 (fdiv), tmp = r1 - q x r2
+    mpz_swap(r1, r2);
+    mpz_swap(r2, tmp);
+    mpz_mul(tmp, q, t2);
+    mpz_sub(tmp, t1, tmp); // tmp = t1 - q x t2
+    mpz_swap(t1, t2);
+    mpz_swap(t2, tmp);
+  }
+  if (mpz_cmp_si(r1, 1) > 0) {
+    mpz_set_ui(o, 0);
+  } else {
+    if (mpz_cmp_si(t1, 0) < 0) {
+      mpz_add(t1, t1, n);
+    }
+    mpz_set(o, t1);
+  }
+  mpz_clears(r1, r2, t1, t2, q, tmp, NULL);
+}
+
+#define GCD_CHECKS 200 // random operand pairs to check gcd and mod_inverse on
+
+// returns true if gcd and mod_inverse agree with the reference on random
+// operands of up to bits bits, with and without common factors and signs
+static bool check_gcd(uint64_t bits, randstate_t *rs) {
+  mpz_t a, b, g, x, y;
+  mpz_inits(a, b, g, x, y, NULL);
+  bool same = true;
+  for (int i = 0; i < GCD_CHECKS && same; i++) {
+    mpz_urandomb(a, rs->mt, bits - gmp_urandomm_ui(rs->mt, bits / 2));
+    mpz_urandomb(b, rs->mt, bits - gmp_urandomm_ui(rs->mt, bits / 2));
+    if (i % 4 == 1) { // a common factor of up to half the size
+      mpz_urandomb(g, rs->mt, 1 + gmp_urandomm_ui(rs->mt, bits / 2));
+      mpz_mul(a, a, g);
+      mpz_mul(b, b, g);
+    }
+    if (i % 8 == 3) {
+      mpz_neg(a, a);
+    }
+    if (i % 8 == 5) {
+      mpz_neg(b, b);
+    }
+    gcd(x, a, b);
+    gcd_ref(y, a, b);
+    same = mpz_cmp(x, y) == 0;
+    mod_inverse(x, a, b);
+    mod_inverse_ref(y, a, b);
+    same = same && mpz_cmp(x, y) == 0;
+  }
+  mpz_clears(a, b, g, x, y, NULL);
+  return same;
+}
+
+// returns the current monotonic time in seconds
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the operands of every benchmarked operation at one key size
+typedef struct {
+  uint64_t bits;
+  mpz_t p, q, n, e, d, s, m, a, b, x, o;
+  mpz_t r; // prime of half the key size
+  rsa_priv_t priv;
+  FILE *plain;  // random plaintext for the file benchmarks
+  FILE *cipher; // its encryption, refreshed by the encrypt benchmark
+  FILE *out;    // scratch output
+  uint64_t length;
+  uint32_t threads;
+  randstate_t rs; // draws the key and every operand
+} fixture_t;
+
+typedef void (*op_t)(fixture_t *f);
+
+static bool first = true; // no comma before the first result
+
+// compares two latencies for qsort
+static int cmp_double(const void *x, const void *y) {
+  double a = *(const double *)x, b = *(const double *)y;
+  return (a > b) - (a < b);
+}
+
+// returns the p-th percentile of the n sorted samples in t
+static double percentile(double *t, uint64_t n, double p) {
+  uint64_t i = (uint64_t)(p * n + 0.999999);
+  return t[i > 0 ? i - 1 : 0];
+}
+
+// times reps calls of op and prints one JSON result. if bytes is nonzero,
+// every call processes that many bytes and MB/s is reported as well
+static void measure(const char *name, const char *variant, op_t op,
+                    fixture_t *f, uint64_t reps, uint64_t bytes) {
+  double *t = (double *)malloc(reps * sizeof(double));
+  double total = 0;
+  for (uint64_t i = 0; i < reps; i++) {
+    double start = now();
+    op(f);
+    t[i] = now() - start;
+    total += t[i];
+  }
+  qsort(t, reps, sizeof(double), cmp_double);
+  printf("%s\n    {\"name\": \"%s\", \"variant\": \"%s\", \"bits\": %" PRIu64
+         ", \"reps\": %" PRIu64 ", \"ops_per_sec\": %.3f",
+         first ? "" : ",", name, variant, f->bits, reps, reps / total);
+  if (bytes > 0) {
+    printf(", \"bytes\": %" PRIu64 ", \"mb_per_sec\": %.3f", bytes,
+           bytes * reps / total / 1e6);
+  }
+  printf(", \"min_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+         "\"p99_us\": %.1f, \"max_us\": %.1f}",
+         t[0] * 1e6, percentile(t, reps, 0.50) * 1e6,
+         percentile(t, reps, 0.90) * 1e6, percentile(t, reps, 0.99) * 1e6,
+         t[reps - 1] * 1e6);
+  fflush(stdout);
+  first = false;
+  free(t);
+}
+
+static void op_make_prime(fixture_t *f) {
+  make_prime(f->o, f->bits / 2, ITERS, &f->rs);
+}
+static void op_is_prime(fixture_t *f) { is_prime(f->r, ITERS, &f->rs); }
+static void op_is_composite(fixture_t *f) { is_prime(f->n, ITERS, &f->rs); }
+static void op_pow_mod(fixture_t *f) { pow_mod(f->o, f->x, f->d, f->n); }
+static void op_pow_mod_ref(fixture_t *f) {
+  pow_mod_ref(f->o, f->x, f->d, f->n);
+}
+static void op_pow_mod_e(fixture_t *f) { pow_mod(f->o, f->x, f->e, f->n); }
+static void op_gcd(fixture_t *f) { gcd(f->o, f->a, f->b); }
+static void op_gcd_ref(fixture_t *f) { gcd_ref(f->o, f->a, f->b); }
+static void op_mod_inverse(fixture_t *f) { mod_inverse(f->o, f->x, f->n); }
+static void op_mod_inverse_ref(fixture_t *f) {
+  mod_inverse_ref(f->o, f->x, f->n);
+}
+static void op_sign(fixture_t *f) { rsa_sign(f->s, f->m, &f->priv); }
+static void op_verify(fixture_t *f) { rsa_verify(f->m, f->s, f->e, f->n); }
+
+// encrypts the plaintext into a fresh ciphertext file
+static void op_encrypt_file(fixture_t *f) {
+  rewind(f->plain);
+  if (f->cipher != NULL) {
+    fclose(f->cipher);
+  }
+  f->cipher = tmpfile();
+  rsa_encrypt_file(f->plain, f->cipher, f->n, f->e, f->threads,
+                   RSA_FORMAT_BIN, NULL);
+  fflush(f->cipher);
+}
+
+// decrypts the ciphertext into a fresh output file
+static void op_decrypt_file(fixture_t *f) {
+  rewind(f->cipher);
+  if (f->out != NULL) {
+    fclose(f->out);
+  }
+  f->out = tmpfile();
+  rsa_decrypt_file(f->cipher, f->out, &f->priv, f->threads, NULL);
+  fflush(f->out);
+}
+
+// returns true if the files a and b hold the same bytes
+static bool same_contents(FILE *a, FILE *b) {
+  rewind(a);
+  rewind(b);
+  int ca, cb;
+  do {
+    ca = fgetc(a);
+    cb = fgetc(b);
+  } while (ca == cb && ca != EOF);
+  return ca == cb;
+}
+
+// generates a key of the given size and the operands of every benchmark
+static void fixture_init(fixture_t *f, uint64_t bits, uint64_t length,
+                         uint32_t threads, uint64_t seed) {
+  randstate_init(&f->rs, seed);
+  f->bits = bits;
+  f->length = length;
+  f->threads = threads;
+  mpz_inits(f->p, f->q, f->n, f->e, f->d, f->s, f->m, f->a, f->b, f->x, f->o,
+            f->r, NULL);
+  rsa_make_pub(f->p, f->q, f->n, f->e, bits, ITERS, 65537, 1, &f->rs);
+  rsa_make_priv(f->d, f->e, f->p, f->q);
+  rsa_priv_init(&f->priv);
+  rsa_priv_set(&f->priv, f->n, f->d, f->p, f->q);
+  mpz_urandomm(f->x, f->rs.mt, f->n);
+  mpz_urandomm(f->m, f->rs.mt, f->n);
+  mpz_urandomb(f->a, f->rs.mt, bits);
+  mpz_urandomb(f->b, f->rs.mt, bits);
+  make_prime(f->r, bits / 2, ITERS, &f->rs);
+  rsa_sign(f->s, f->m, &f->priv);
+
+  f->plain = tmpfile();
+  for (uint64_t i = 0; i < length; i++) {
+    fputc(gmp_urandomb_ui(f->rs.mt, 8), f->plain);
+  }
+  fflush(f->plain);
+  f->cipher = NULL;
+  f->out = NULL;
+}
+
+// frees a fixture
+static void fixture_clear(fixture_t *f) {
+  mpz_clears(f->p, f->q, f->n, f->e, f->d, f->s, f->m, f->a, f->b, f->x, f->o,
+             f->r, NULL);
+  rsa_priv_clear(&f->priv);
+  fclose(f->plain);
+  if (f->cipher != NULL) {
+    fclose(f->cipher);
+  }
+  if (f->out != NULL) {
+    fclose(f->out);
+  }
+  randstate_clear(&f->rs);
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: ./bench [options]\n");
+  fprintf(stderr, "  ./bench times the number theory and RSA operations at "
+                  "fixed seeds and\n  prints the results as JSON.\n");
+  fprintf(stderr, "    -s <seed>   : Use <seed> as the random number seed. "
+                  "Default: 2022\n");
+  fprintf(stderr, "    -r <reps>   : Time <reps> calls per measurement. "
+                  "Default: 20\n");
+  fprintf(stderr, "    -b <bits>   : Only benchmark keys of <bits> bits. "
+                  "Default: 1024 to 4096\n");
+  fprintf(stderr, "    -l <bytes>  : Encrypt and decrypt files of <bytes> "
+                  "bytes. Default: 262144\n");
+  fprintf(stderr, "    -t <threads>: Encrypt and decrypt files with "
+                  "<threads> threads. Default: 1\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
+
+int main(int argc, char **argv) {
+  uint64_t seed = 2022;      // fixed default seed so runs are comparable
+  uint64_t reps = 20;        // calls per measurement
+  uint64_t only = 0;         // single key size to run, or 0 for all
+  uint64_t length = 1 << 18; // bytes per file benchmark
+  uint32_t threads = 1;
+  int64_t opt = 0;
+  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    switch (opt) {
+    case 's':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    case 'r':
+      reps = strtoull(optarg, NULL, 10);
+      break;
+    case 'b':
+      only = strtoull(optarg, NULL, 10);
+      break;
+    case 'l':
+      length = strtoull(optarg, NULL, 10);
+      break;
+    case 't':
+      threads = strtoul(optarg, NULL, 10);
+      break;
+    case 'h':
+      usage();
+      return 0;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (reps == 0) {
+    reps = 1;
+  }
+  if (threads == 0) {
+    threads = 1;
+  }
+
+  uint64_t sizes[] = { 1024, 2048, 3072, 4096 };
+  printf("{\n  \"seed\": %" PRIu64 ",\n  \"reps\": %" PRIu64
+         ",\n  \"threads\": %" PRIu32 ",\n  \"results\": [",
+         seed, reps, threads);
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    if (only != 0 && sizes[i] != only) {
+      continue;
+    }
+    fixture_t f; // each size is reproducible on its own from seed + bits
+    fixture_init(&f, sizes[i], length, threads, seed + sizes[i]);
+
+    pow_mod(f.o, f.x, f.d, f.n);
+    pow_mod_ref(f.s, f.x, f.d, f.n);
+    if (mpz_cmp(f.o, f.s) != 0) {
+      fprintf(stderr, "Error: pow_mod disagrees with reference at %" PRIu64
+                      " bits\n",
+              sizes[i]);
+      return 1;
+    }
+    if (!check_gcd(sizes[i], &f.rs)) {
+      fprintf(stderr, "Error: gcd disagrees with reference at %" PRIu64
+                      " bits\n",
+              sizes[i]);
+      return 1;
+    }
+    rsa_sign(f.s, f.m, &f.priv);
+
+    uint64_t slow = reps / 4 > 0 ? reps / 4 : 1; // for the costly operations
+    measure("make_prime", "half", op_make_prime, &f, slow, 0);
+    measure("is_prime", "prime", op_is_prime, &f, slow, 0);
+    measure("is_prime", "composite", op_is_composite, &f, reps, 0);
+    measure("pow_mod", "full", op_pow_mod, &f, reps, 0);
+    measure("pow_mod_ref", "full", op_pow_mod_ref, &f, slow, 0);
+    measure("pow_mod", "65537", op_pow_mod_e, &f, reps * 50, 0);
+    measure("gcd", "full", op_gcd, &f, reps * 50, 0);
+    measure("gcd_ref", "full", op_gcd_ref, &f, reps * 50, 0);
+    measure("mod_inverse", "full", op_mod_inverse, &f, reps * 50, 0);
+    measure("mod_inverse_ref", "full", op_mod_inverse_ref, &f, reps * 50, 0);
+    measure("sign", "crt", op_sign, &f, reps, 0);
+    measure("verify", "65537", op_verify, &f, reps * 50, 0);
+    if (length > 0) {
+      measure("encrypt_file", "binary", op_encrypt_file, &f, slow, length);
+      measure("decrypt_file", "binary", op_decrypt_file, &f, slow, length);
+      if (!same_contents(f.plain, f.out)) {
+        fprintf(stderr, "Error: file round trip failed at %" PRIu64 " bits\n",
+                sizes[i]);
+        return 1;
+      }
+    }
+    fixture_clear(&f);
+  }
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,304 @@
+#include "chacha.h"
+// clang-format off
+#include <string.h>
+// clang-format on
+
+// loads a little-endian 32 bit word
+static uint32_t le32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+// stores a little-endian 32 bit word
+static void put_le32(uint8_t *p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d)                                                    \
+  a += b;                                                                      \
+  d = ROTL(d ^ a, 16);                                                         \
+  c += d;                                                                      \
+  b = ROTL(b ^ c, 12);                                                         \
+  a += b;                                                                      \
+  d = ROTL(d ^ a, 8);                                                          \
+  c += d;                                                                      \
+  b = ROTL(b ^ c, 7);
+
+// computes one 64 byte ChaCha20 keystream block for the given input state
+static void chacha20_block(uint8_t out[64], const uint32_t in[16]) {
+  uint32_t x[16];
+  memcpy(x, in, sizeof(x));
+  for (int i = 0; i < 10; i++) { // 20 rounds: 10 column and 10 diagonal
+    QUARTER(x[0], x[4], x[8], x[12]);
+    QUARTER(x[1], x[5], x[9], x[13]);
+    QUARTER(x[2], x[6], x[10], x[14]);
+    QUARTER(x[3], x[7], x[11], x[15]);
+    QUARTER(x[0], x[5], x[10], x[15]);
+    QUARTER(x[1], x[6], x[11], x[12]);
+    QUARTER(x[2], x[7], x[8], x[13]);
+    QUARTER(x[3], x[4], x[9], x[14]);
+  }
+  for (int i = 0; i < 16; i++) {
+    put_le32(out + 4 * i, x[i] + in[i]);
+  }
+}
+
+// sets up the ChaCha20 input state: constants, key, counter and nonce
+static void chacha20_init(uint32_t s[16], const uint8_t key[CHACHA_KEY_BYTES],
+                          const uint8_t nonce[CHACHA_NONCE_BYTES],
+                          uint32_t counter) {
+  s[0] = 0x61707865; // "expand 32-byte k"
+  s[1] = 0x3320646e;
+  s[2] = 0x79622d32;
+  s[3] = 0x6b206574;
+  for (int i = 0; i < 8; i++) {
+    s[4 + i] = le32(key + 4 * i);
+  }
+  s[12] = counter;
+  for (int i = 0; i < 3; i++) {
+    s[13 + i] = le32(nonce + 4 * i);
+  }
+}
+
+// xors in with the ChaCha20 keystream starting at block counter
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t len,
+                  const uint8_t key[CHACHA_KEY_BYTES],
+                  const uint8_t nonce[CHACHA_NONCE_BYTES], uint32_t counter) {
+  uint32_t s[16];
+  uint8_t ks[64];
+  chacha20_init(s, key, nonce, counter);
+  while (len > 0) {
+    chacha20_block(ks, s);
+    s[12]++;
+    size_t n = len < 64 ? len : 64;
+    for (size_t i = 0; i < n; i++) {
+      out[i] = in[i] ^ ks[i];
+    }
+    out += n;
+    in += n;
+    len -= n;
+  }
+}
+
+// poly1305 state in radix 2^26 (five 26 bit limbs per value)
+typedef struct {
+  uint32_t r[5];
+  uint32_t h[5];
+  uint32_t pad[4];
+  uint8_t buf[16]; // partial block
+  size_t used;     // bytes in buf
+} poly1305_t;
+
+// sets up poly1305 with a 32 byte one-time key
+static void poly1305_init(poly1305_t *p, const uint8_t key[32]) {
+  p->r[0] = le32(key + 0) & 0x3ffffff; // r is clamped as the RFC requires
+  p->r[1] = (le32(key + 3) >> 2) & 0x3ffff03;
+  p->r[2] = (le32(key + 6) >> 4) & 0x3ffc0ff;
+  p->r[3] = (le32(key + 9) >> 6) & 0x3f03fff;
+  p->r[4] = (le32(key + 12) >> 8) & 0x00fffff;
+  memset(p->h, 0, sizeof(p->h));
+  for (int i = 0; i < 4; i++) {
+    p->pad[i] = le32(key + 16 + 4 * i);
+  }
+  p->used = 0;
+}
+
+// absorbs whole 16 byte blocks; hibit is 1 << 24 for message blocks and 0 for
+// the already padded final block
+static void poly1305_blocks(poly1305_t *p, const uint8_t *m, size_t len,
+                            uint32_t hibit) {
+  const uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3],
+                 r4 = p->r[4];
+  const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+  uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3],
+           h4 = p->h[4];
+  while (len >= 16) {
+    h0 += le32(m + 0) & 0x3ffffff; // h += m
+    h1 += (le32(m + 3) >> 2) & 0x3ffffff;
+    h2 += (le32(m + 6) >> 4) & 0x3ffffff;
+    h3 += (le32(m + 9) >> 6) & 0x3ffffff;
+    h4 += (le32(m + 12) >> 8) | hibit;
+
+    uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 +
+                  (uint64_t)h3 * s2 + (uint64_t)h4 * s1; // h *= r mod 2^130-5
+    uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 +
+                  (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+    uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 +
+                  (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+    uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 +
+                  (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+    uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 +
+                  (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+    uint32_t c = (uint32_t)(d0 >> 26); // partial carry propagation
+    h0 = (uint32_t)d0 & 0x3ffffff;
+    d1 += c;
+    c = (uint32_t)(d1 >> 26);
+    h1 = (uint32_t)d1 & 0x3ffffff;
+    d2 += c;
+    c = (uint32_t)(d2 >> 26);
+    h2 = (uint32_t)d2 & 0x3ffffff;
+    d3 += c;
+    c = (uint32_t)(d3 >> 26);
+    h3 = (uint32_t)d3 & 0x3ffffff;
+    d4 += c;
+    c = (uint32_t)(d4 >> 26);
+    h4 = (uint32_t)d4 & 0x3ffffff;
+    h0 += c * 5;
+    c = h0 >> 26;
+    h0 &= 0x3ffffff;
+    h1 += c;
+
+    m += 16;
+    len -= 16;
+  }
+  p->h[0] = h0;
+  p->h[1] = h1;
+  p->h[2] = h2;
+  p->h[3] = h3;
+  p->h[4] = h4;
+}
+
+// absorbs len bytes of message
+static void poly1305_update(poly1305_t *p, const uint8_t *m, size_t len) {
+  if (p->used > 0) { // top up the partial block first
+    size_t n = 16 - p->used < len ? 16 - p->used : len;
+    memcpy(p->buf + p->used, m, n);
+    p->used += n;
+    m += n;
+    len -= n;
+    if (p->used < 16) {
+      return;
+    }
+    poly1305_blocks(p, p->buf, 16, 1 << 24);
+    p->used = 0;
+  }
+  size_t whole = len & ~(size_t)15;
+  poly1305_blocks(p, m, whole, 1 << 24);
+  memcpy(p->buf, m + whole, len - whole);
+  p->used = len - whole;
+}
+
+// absorbs zero bytes up to the next 16 byte boundary, as the AEAD requires
+static void poly1305_pad16(poly1305_t *p) {
+  static const uint8_t zeros[16] = { 0 };
+  if (p->used > 0) {
+    poly1305_update(p, zeros, 16 - p->used);
+  }
+}
+
+// finishes the mac, writing the 16 byte tag
+static void poly1305_finish(poly1305_t *p, uint8_t tag[16]) {
+  if (p->used > 0) { // final partial block gets a 1 byte then zero padding
+    p->buf[p->used++] = 1;
+    memset(p->buf + p->used, 0, 16 - p->used);
+    poly1305_blocks(p, p->buf, 16, 0);
+  }
+  uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3],
+           h4 = p->h[4];
+  uint32_t c = h1 >> 26; // full carry propagation
+  h1 &= 0x3ffffff;
+  h2 += c;
+  c = h2 >> 26;
+  h2 &= 0x3ffffff;
+  h3 += c;
+  c = h3 >> 26;
+  h3 &= 0x3ffffff;
+  h4 += c;
+  c = h4 >> 26;
+  h4 &= 0x3ffffff;
+  h0 += c * 5;
+  c = h0 >> 26;
+  h0 &= 0x3ffffff;
+  h1 += c;
+
+  uint32_t g0 = h0 + 5; // g = h + 5 - 2^130, used if h >= 2^130 - 5
+  c = g0 >> 26;
+  g0 &= 0x3ffffff;
+  uint32_t g1 = h1 + c;
+  c = g1 >> 26;
+  g1 &= 0x3ffffff;
+  uint32_t g2 = h2 + c;
+  c = g2 >> 26;
+  g2 &= 0x3ffffff;
+  uint32_t g3 = h3 + c;
+  c = g3 >> 26;
+  g3 &= 0x3ffffff;
+  uint32_t g4 = h4 + c - (1UL << 26);
+
+  uint32_t mask = (g4 >> 31) - 1; // all ones if g did not go negative
+  h0 = (h0 & ~mask) | (g0 & mask);
+  h1 = (h1 & ~mask) | (g1 & mask);
+  h2 = (h2 & ~mask) | (g2 & mask);
+  h3 = (h3 & ~mask) | (g3 & mask);
+  h4 = (h4 & ~mask) | (g4 & mask);
+
+  h0 = h0 | (h1 << 26); // back to radix 2^32, then add the pad
+  h1 = (h1 >> 6) | (h2 << 20);
+  h2 = (h2 >> 12) | (h3 << 14);
+  h3 = (h3 >> 18) | (h4 << 8);
+  uint64_t f = (uint64_t)h0 + p->pad[0];
+  put_le32(tag + 0, (uint32_t)f);
+  f = (uint64_t)h1 + p->pad[1] + (f >> 32);
+  put_le32(tag + 4, (uint32_t)f);
+  f = (uint64_t)h2 + p->pad[2] + (f >> 32);
+  put_le32(tag + 8, (uint32_t)f);
+  f = (uint64_t)h3 + p->pad[3] + (f >> 32);
+  put_le32(tag + 12, (uint32_t)f);
+}
+
+// computes the AEAD tag over aad and the ciphertext ct
+static void aead_tag(const uint8_t *ct, size_t len, const uint8_t *aad,
+                     size_t aad_len, const uint8_t key[CHACHA_KEY_BYTES],
+                     const uint8_t nonce[CHACHA_NONCE_BYTES],
+                     uint8_t tag[CHACHA_TAG_BYTES]) {
+  uint8_t otk[64] = { 0 };
+  chacha20_xor(otk, otk, sizeof(otk), key, nonce, 0); // one-time poly key
+  poly1305_t p;
+  poly1305_init(&p, otk);
+  poly1305_update(&p, aad, aad_len);
+  poly1305_pad16(&p);
+  poly1305_update(&p, ct, len);
+  poly1305_pad16(&p);
+  uint8_t lens[16];
+  put_le32(lens + 0, (uint32_t)aad_len);
+  put_le32(lens + 4, (uint32_t)((uint64_t)aad_len >> 32));
+  put_le32(lens + 8, (uint32_t)len);
+  put_le32(lens + 12, (uint32_t)((uint64_t)len >> 32));
+  poly1305_update(&p, lens, sizeof(lens));
+  poly1305_finish(&p, tag);
+}
+
+// encrypts buf in place and computes its tag
+void chacha20_poly1305_seal(uint8_t *buf, size_t len, const uint8_t *aad,
+                            size_t aad_len,
+                            const uint8_t key[CHACHA_KEY_BYTES],
+                            const uint8_t nonce[CHACHA_NONCE_BYTES],
+                            uint8_t tag[CHACHA_TAG_BYTES]) {
+  chacha20_xor(buf, buf, len, key, nonce, 1);
+  aead_tag(buf, len, aad, aad_len, key, nonce, tag);
+}
+
+// checks the tag of buf and decrypts it in place if it matches
+bool chacha20_poly1305_open(uint8_t *buf, size_t len, const uint8_t *aad,
+                            size_t aad_len,
+                            const uint8_t key[CHACHA_KEY_BYTES],
+                            const uint8_t nonce[CHACHA_NONCE_BYTES],
+                            const uint8_t tag[CHACHA_TAG_BYTES]) {
+  uint8_t expect[CHACHA_TAG_BYTES];
+  aead_tag(buf, len, aad, aad_len, key, nonce, expect);
+  uint8_t diff = 0; // compare in constant time
+  for (int i = 0; i < CHACHA_TAG_BYTES; i++) {
+    diff |= expect[i] ^ tag[i];
+  }
+  if (diff != 0) {
+    return false;
+  }
+  chacha20_xor(buf, buf, len, key, nonce, 1);
+  return true;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+// clang-format off
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+// clang-format on
+
+#define CHACHA_KEY_BYTES   32 // bytes in a ChaCha20 key
+#define CHACHA_NONCE_BYTES 12 // bytes in a ChaCha20 nonce
+#define CHACHA_TAG_BYTES   16 // bytes in a Poly1305 tag
+
+//
+// XORs len bytes of in with the ChaCha20 keystream (RFC 8439), writing the
+// result to out. Encryption and decryption are the same operation.
+// in and out may be the same buffer.
+//
+// out: the output buffer of len bytes.
+// in: the input buffer of len bytes.
+// len: the number of bytes to process.
+// key: the 32 byte key.
+// nonce: the 12 byte nonce.
+// counter: the block counter of the first 64 byte block.
+//
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t len,
+                  const uint8_t key[CHACHA_KEY_BYTES],
+                  const uint8_t nonce[CHACHA_NONCE_BYTES], uint32_t counter);
+
+//
+// Encrypts a message with ChaCha20-Poly1305 (RFC 8439) in place.
+//
+// buf: the message, replaced by its ciphertext.
+// len: the number of bytes in buf.
+// aad: additional data that is authenticated but not encrypted.
+// aad_len: the number of bytes in aad.
+// key: the 32 byte key.
+// nonce: the 12 byte nonce; must never repeat for the same key.
+// tag: will store the 16 byte authentication tag.
+//
+void chacha20_poly1305_seal(uint8_t *buf, size_t len, const uint8_t *aad,
+                            size_t aad_len,
+                            const uint8_t key[CHACHA_KEY_BYTES],
+                            const uint8_t nonce[CHACHA_NONCE_BYTES],
+                            uint8_t tag[CHACHA_TAG_BYTES]);
+
+//
+// Verifies and decrypts a ChaCha20-Poly1305 ciphertext in place.
+// buf is left untouched if the tag does not match.
+//
+// buf: the ciphertext, replaced by its plaintext.
+// len: the number of bytes in buf.
+// aad: the additional data given when sealing.
+// aad_len: the number of bytes in aad.
+// key: the 32 byte key.
+// nonce: the 12 byte nonce.
+// tag: the 16 byte tag to verify.
+// returns: true if the tag is valid, false otherwise.
+//
+bool chacha20_poly1305_open(uint8_t *buf, size_t len, const uint8_t *aad,
+                            size_t aad_len,
+                            const uint8_t key[CHACHA_KEY_BYTES],
+                            const uint8_t nonce[CHACHA_NONCE_BYTES],
+                            const uint8_t tag[CHACHA_TAG_BYTES]);
@@ -3,26 +3,128 @@
 #include <gmp.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <sys/stat.h>
 #include <time.h>
+#include "keycache.h"
 #include "numtheory.h"
 #include "randstate.h"
 #include "rsa.h"
+#include "service.h"
+#include "stats.h"
 // clang-format on
 
-#define OPTIONS "i:o:n:vh"
+#define OPTIONS "i:o:n:t:S:k:vh"
+#define OPT_STATS  256 // --stats has no short form
+#define OPT_OFFSET 257 // neither has --offset
+#define OPT_LENGTH 258 // nor --length
+
+static const struct option long_options[] = {
+  { "stats", optional_argument, NULL, OPT_STATS },
+  { "offset", required_argument, NULL, OPT_OFFSET },
+  { "length", required_argument, NULL, OPT_LENGTH },
+  { NULL, 0, NULL, 0 },
+};
+
+// prints the program synopsis and usage
+static void usage(void) {
+  fprintf(stderr, "Usage: ./decrypt [options]\n");
+  fprintf(stderr, "  ./decrypt decrypts an input file using the specified "
+                  "private key file,\n");
+  fprintf(stderr, "  writing the result to the specified output file.\n");
+  fprintf(stderr, "    -i <infile> : Read input from <infile>. Default: "
+                  "standard input.\n");
+  fprintf(stderr, "    -o <outfile>: Write output to <outfile>. Default: "
+                  "standard output.\n");
+  fprintf(stderr, "    -n <keyfile>: Private key is in <keyfile>, as written "
+                  "by keygen or\n                  keyprep. Default: "
+                  "rsa.priv.\n");
+  fprintf(stderr, "    -t <threads>: Decrypt with <threads> worker threads. "
+                  "Default: 1\n");
+  fprintf(stderr, "    -S <socket> : Have the rsad server listening on "
+                  "<socket> decrypt,\n");
+  fprintf(stderr, "                  instead of loading a private key.\n");
+  fprintf(stderr, "    -k <key>    : Use key number <key> of the rsad "
+                  "server. Default: 0\n");
+  fprintf(stderr, "    --offset <n>: Start the output at plaintext byte "
+                  "<n>. Default: 0\n");
+  fprintf(stderr, "    --length <n>: Write at most <n> plaintext bytes, "
+                  "decrypting only the\n");
+  fprintf(stderr, "                  records that hold them. Default: "
+                  "all\n");
+  fprintf(stderr, "    -v          : Enable verbose output.\n");
+  fprintf(stderr, "    --stats[=json]: Print counters and timings to "
+                  "stderr when done.\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
+
+// sends infile to the rsad server at path and writes the plaintext it
+// returns to outfile; returns false if the server failed or refused
+static bool decrypt_remote(FILE *infile, FILE *outfile, const char *path,
+                           uint8_t keyno) {
+  uint64_t start = stats_start();
+  uint8_t *req = NULL;
+  size_t len = 0, cap = 0;
+  size_t got;
+  do { // read the whole input, which may be a pipe
+    if (len == cap) {
+      cap = cap > 0 ? 2 * cap : 1 << 16;
+      req = (uint8_t *)realloc(req, cap);
+    }
+    got = fread(req + len, sizeof(uint8_t), cap - len, infile);
+    len += got;
+  } while (got > 0 && len <= SVC_MAX_PAYLOAD);
+  stats_add(STAT_BYTES_IN, len);
+  stats_stop(STAT_IO, start);
+  if (len > SVC_MAX_PAYLOAD) {
+    fprintf(stderr, "Error: Input too large for rsad\n");
+    free(req);
+    return false;
+  }
+  svc_status_t status;
+  uint8_t *resp;
+  uint32_t rlen;
+  start = stats_start();
+  bool ok = svc_call(path, SVC_DECRYPT, keyno, req, (uint32_t)len, &status,
+                     &resp, &rlen);
+  stats_stop(STAT_MATH, start);
+  free(req);
+  if (!ok) {
+    fprintf(stderr, "Error: rsad couldn't be reached at %s\n", path);
+    return false;
+  }
+  if (status != SVC_OK) {
+    fprintf(stderr, "Error: rsad: %s\n", svc_status_name(status));
+    free(resp);
+    return false;
+  }
+  start = stats_start();
+  fwrite(resp, sizeof(uint8_t), rlen, outfile);
+  stats_add(STAT_BYTES_OUT, rlen);
+  stats_stop(STAT_IO, start);
+  free(resp);
+  return true;
+}
 
 int main(int argc, char **argv) {
   // declare files for decrypting
   FILE *infile = stdin;
   FILE *outfile = stdout;
-  FILE *pvfile;
+  FILE *pvfile = NULL;
   bool verbose = false; // default for verbose output = false
   bool user_set_file = false;
+  uint32_t threads = 1; // default number of worker threads = 1
+  bool stats_json = false; // print --stats as JSON instead of text
+  const char *server = NULL; // rsad socket, if decrypting remotely
+  uint8_t keyno = 0;          // key number on the rsad server
+  uint64_t offset = 0;        // first plaintext byte to write
+  uint64_t length = UINT64_MAX; // default is the rest of the plaintext
   int32_t opt = 0;
-  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+  while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) !=
+         -1) {
     switch (opt) {
     case 'v':
       verbose = true;
@@ -49,58 +151,114 @@ int main(int argc, char **argv) {
       }
       user_set_file = true;
       break;
+    case 't':
+      threads = strtoul(optarg, NULL, 10); // setting threads to optarg
+      if (threads == 0) {
+        fprintf(stderr, "threads must be at least 1\n");
+        return 1;
+      }
+      break;
+    case 'S':
+      server = optarg;
+      break;
+    case 'k':
+    {
+      char *end;
+      unsigned long k = strtoul(optarg, &end, 10); // setting keyno to optarg
+      if (end == optarg || *end != '\0' || k > UINT8_MAX) {
+        fprintf(stderr, "key number must be between 0 and 255\n");
+        return 1;
+      }
+      keyno = (uint8_t)k;
+      break;
+    }
     case 'h':
-      fprintf(stderr, "Usage: ./decrypt [options]\n");
-      fprintf(stderr, "  ./decrypt decrypts an input file using the specified "
-                      "private key file,\n");
-      fprintf(stderr, "  writing the result to the specified output file.\n");
-      fprintf(stderr, "    -i <infile> : Read input from <infile>. Default: "
-                      "standard input.\n");
-      fprintf(stderr, "    -o <outfile>: Write output to <outfile>. Default: "
-                      "standard output.\n");
-      fprintf(stderr, "    -n <keyfile>: Private key is in <keyfile>. Default: "
-                      "rsa.priv.\n");
-      fprintf(stderr, "    -v          : Enable verbose output.\n");
-      fprintf(stderr,
-              "    -h          : Display program synopsis and usage.\n");
+      usage();
       return 0;
+    case OPT_OFFSET:
+      offset = strtoull(optarg, NULL, 10);
+      break;
+    case OPT_LENGTH:
+      length = strtoull(optarg, NULL, 10);
+      break;
+    case OPT_STATS:
+      if (!stats_parse_opt(optarg, &stats_json)) {
+        return 1;
+      }
+      break;
     default:
-      fprintf(stderr, "Usage: ./decrypt [options]\n");
-      fprintf(stderr, "  ./decrypt decrypts an input file using the specified "
-                      "private key file,\n");
-      fprintf(stderr, "  writing the result to the specified output file.\n");
-      fprintf(stderr, "    -i <infile> : Read input from <infile>. Default: "
-                      "standard input.\n");
-      fprintf(stderr, "    -o <outfile>: Write output to <outfile>. Default: "
-                      "standard output.\n");
-      fprintf(stderr, "    -n <keyfile>: Private key is in <keyfile>. Default: "
-                      "rsa.priv.\n");
-      fprintf(stderr, "    -v          : Enable verbose output.\n");
-      fprintf(stderr,
-              "    -h          : Display program synopsis and usage.\n");
+      usage();
       return 1;
     }
   }
 
+  if (server != NULL && (offset != 0 || length != UINT64_MAX)) {
+    fprintf(stderr, "--offset and --length can't be used with -S\n");
+    return 1;
+  }
+  if (server != NULL) { // the server holds the key
+    bool ok = decrypt_remote(infile, outfile, server, keyno);
+    if (stats_enabled) {
+      stats_print(stderr, stats_json);
+    }
+    fclose(infile);
+    fclose(outfile);
+    if (user_set_file) {
+      fclose(pvfile);
+    }
+    return ok ? 0 : 1;
+  }
+
   if (user_set_file == false) {      // if user has not set pvfile
     pvfile = fopen("rsa.priv", "r"); // open priv key file
   }
 
-  mpz_t n, d;
-  mpz_inits(n, d,
-            NULL); // initialize mpz vars for public modulus n and priv key d
-  rsa_read_priv(n, d, pvfile); // read from opened priv key file
+  rsa_priv_t parsed;
+  rsa_priv_init(&parsed); // initialize mpz vars for modulus n and priv key d
+  rsa_priv_t *key = &parsed; // the parsed key or views of a compiled one
+  keycache_t kc = { .base = NULL };
+  bool loaded;
+  if (keycache_probe(pvfile)) { // compiled by keyprep, use it in place
+    loaded = keycache_map(&kc, pvfile) && kc.priv;
+    key = &kc.key;
+  } else {
+    loaded = rsa_read_priv(&parsed, pvfile); // read from opened priv key file
+  }
+  if (!loaded) {
+    fprintf(stderr, "Error: Malformed private key file\n");
+    rsa_priv_clear(&parsed);
+    keycache_unmap(&kc);
+    fclose(infile);
+    fclose(outfile);
+    fclose(pvfile);
+    return 1;
+  }
 
   if (verbose) { // if verbose output is enabled
-    gmp_printf("n - modulus (%d bits): %Zd\n", mpz_sizeinbase(n, 2), n);
-    gmp_printf("d - modulus (%d bits): %Zd\n", mpz_sizeinbase(d, 2), d);
+    gmp_printf("n - modulus (%d bits): %Zd\n", mpz_sizeinbase(key->n, 2),
+               key->n);
+    gmp_printf("d - modulus (%d bits): %Zd\n", mpz_sizeinbase(key->d, 2),
+               key->d);
+    if (!key->crt) {
+      printf("legacy key: decrypting without CRT\n");
+    }
   }
 
-  rsa_decrypt_file(infile, outfile, n, d); // decrypt file
+  rsa_error_t err;
+  bool ok = rsa_decrypt_range(infile, outfile, key, threads, offset, length,
+                              &err); // decrypt the range of the file
+  if (stats_enabled) {
+    stats_print(stderr, stats_json);
+  }
+  if (!ok) {
+    fprintf(stderr, "Error: Ciphertext rejected at byte %" PRIu64 ": %s\n",
+            err.offset, err.reason);
+  }
 
   fclose(infile);
   fclose(outfile);
-  fclose(pvfile);         // close used files
-  mpz_clears(n, d, NULL); // clear mpz vars
-  return 0;
+  fclose(pvfile);        // close used files
+  rsa_priv_clear(&parsed); // clear mpz vars
+  keycache_unmap(&kc);
+  return ok ? 0 : 1;
 }
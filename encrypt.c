@@ -7,42 +7,76 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#include <getopt.h>
+#include "keycache.h"
 #include "numtheory.h"
 #include "randstate.h"
 #include "rsa.h"
+#include "stats.h"
 // clang-format on
 
-#define OPTIONS "i:o:n:vh" // options
+#define OPTIONS "i:o:n:t:bHvh" // options
+#define OPT_STATS 256 // --stats has no short form
+
+static const struct option long_options[] = {
+  { "stats", optional_argument, NULL, OPT_STATS },
+  { NULL, 0, NULL, 0 },
+};
+
+// prints the program synopsis and usage
+static void usage(void) {
+  fprintf(stderr, "Usage: ./encrypt [options]\n");
+  fprintf(stderr, "  ./encrypt encrypts an input file using the specified "
+                  "public key file,\n");
+  fprintf(stderr, "  writing the result to the specified output file.\n");
+  fprintf(stderr, "    -i <infile> : Read input from <infile>. Default: "
+                  "standard input.\n");
+  fprintf(stderr, "    -o <outfile>: Write output to <outfile>. Default: "
+                  "standard output.\n");
+  fprintf(stderr,
+          "    -n <keyfile>: Public key is in <keyfile>, as written by keygen "
+          "or keyprep.\n"
+          "                  Default: rsa.pub.\n");
+  fprintf(stderr, "    -t <threads>: Encrypt with <threads> worker threads. "
+                  "Default: 1\n");
+  fprintf(stderr, "    -b          : Write binary records instead of hex "
+                  "lines.\n");
+  fprintf(stderr, "    -H          : Hybrid mode: wrap a random key with RSA "
+                  "and encrypt\n");
+  fprintf(stderr, "                  the data with ChaCha20-Poly1305.\n");
+  fprintf(stderr, "    -v          : Enable verbose output.\n");
+  fprintf(stderr, "    --stats[=json]: Print counters and timings to "
+                  "stderr when done.\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
 
 int main(int argc, char **argv) {
   // declare files for encrypting
   FILE *infile = stdin;
   FILE *outfile = stdout;
+  const char *outpath = NULL; // removed again if nothing is encrypted
   FILE *pbfile;
   bool verbose = false;
   bool user_set_file = false;
+  uint32_t threads = 1; // default number of worker threads = 1
+  rsa_format_t format = RSA_FORMAT_HEX; // default output format = hex lines
+  bool stats_json = false; // print --stats as JSON instead of text
   int32_t opt = 0;
-  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+  while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) !=
+         -1) {
     switch (opt) {
     case 'h': // print help msg
-      fprintf(stderr, "Usage: ./encrypt [options]\n");
-      fprintf(stderr, "  ./encrypt encrypts an input file using the specified "
-                      "public key file,\n");
-      fprintf(stderr, "  writing the result to the specified output file.\n");
-      fprintf(stderr, "    -i <infile> : Read input from <infile>. Default: "
-                      "standard input.\n");
-      fprintf(stderr, "    -o <outfile>: Write output to <outfile>. Default: "
-                      "standard output.\n");
-      fprintf(
-          stderr,
-          "    -n <keyfile>: Public key is in <keyfile>. Default: rsa.pub.\n");
-      fprintf(stderr, "    -v          : Enable verbose output.\n");
-      fprintf(stderr,
-              "    -h          : Display program synopsis and usage.\n");
+      usage();
       return 0;
     case 'v':
       verbose = true; // enable verbose output
       break;
+    case 'b':
+      format = RSA_FORMAT_BIN; // write binary records
+      break;
+    case 'H':
+      format = RSA_FORMAT_HYBRID; // wrap a session key, stream cipher the rest
+      break;
     case 'i':
       infile = fopen(optarg, "r");
       if (infile == NULL) {
@@ -56,6 +90,7 @@ int main(int argc, char **argv) {
         fprintf(stderr, "outfile couldn't be opened\n");
         return 1;
       }
+      outpath = optarg;
       break;
     case 'n':
       pbfile = fopen(optarg, "r");
@@ -65,21 +100,20 @@ int main(int argc, char **argv) {
       }
       user_set_file = true;
       break;
+    case 't':
+      threads = strtoul(optarg, NULL, 10); // setting threads to optarg
+      if (threads == 0) {
+        fprintf(stderr, "threads must be at least 1\n");
+        return 1;
+      }
+      break;
+    case OPT_STATS:
+      if (!stats_parse_opt(optarg, &stats_json)) {
+        return 1;
+      }
+      break;
     default:
-      fprintf(stderr, "Usage: ./encrypt [options]\n");
-      fprintf(stderr, "  ./encrypt encrypts an input file using the specified "
-                      "public key file,\n");
-      fprintf(stderr, "  writing the result to the specified output file.\n");
-      fprintf(stderr, "    -i <infile> : Read input from <infile>. Default: "
-                      "standard input.\n");
-      fprintf(stderr, "    -o <outfile>: Write output to <outfile>. Default: "
-                      "standard output.\n");
-      fprintf(
-          stderr,
-          "    -n <keyfile>: Public key is in <keyfile>. Default: rsa.pub.\n");
-      fprintf(stderr, "    -v          : Enable verbose output.\n");
-      fprintf(stderr,
-              "    -h          : Display program synopsis and usage.\n");
+      usage();
       return 1;
     }
   }
@@ -87,11 +121,44 @@ int main(int argc, char **argv) {
     pbfile = fopen("rsa.pub", "r"); // Open the public key file.
   }
 
-  mpz_t n, e, s, username;
-  mpz_inits(n, e, s, username, NULL);
-  char *userid = getenv("USER"); // get userid
+  mpz_t pn, pe, ps, username;
+  mpz_inits(pn, pe, ps, username, NULL);
+  mpz_ptr n = pn, e = pe, s = ps; // the parsed key or views of a compiled one
+  char *userid = NULL;  // the username the key signs
+  char *userbuf = NULL; // holds it for a parsed key
 
-  rsa_read_pub(n, e, s, userid, pbfile); // read public key from open pbfile
+  keycache_t kc = { .base = NULL };
+  if (keycache_probe(pbfile)) { // compiled by keyprep, use it in place
+    if (!keycache_map(&kc, pbfile) || kc.priv) {
+      fprintf(stderr, "Error: Unusable compiled public key file\n");
+      keycache_unmap(&kc);
+      mpz_clears(pn, pe, ps, username, NULL);
+      return 1;
+    }
+    n = kc.n;
+    e = kc.e;
+    s = kc.s;
+    userid = (char *)kc.username;
+  } else {
+    struct stat st;
+    if (fstat(fileno(pbfile), &st) == 0) {
+      userbuf = (char *)malloc(st.st_size + 1); // can't outgrow the file
+    }
+    if (userbuf == NULL || !rsa_read_pub(n, e, s, userbuf, pbfile) ||
+        mpz_sgn(n) <= 0) { // read public key from open pbfile
+      fprintf(stderr, "Error: Malformed public key file\n");
+      free(userbuf);
+      mpz_clears(pn, pe, ps, username, NULL);
+      fclose(infile);
+      fclose(outfile);
+      fclose(pbfile);
+      if (outpath != NULL) {
+        unlink(outpath); // don't leave an empty output behind
+      }
+      return 1;
+    }
+    userid = userbuf;
+  }
 
   if (verbose) { // if verbose output is enabled print the following
     printf("username: %s\n", userid);
@@ -100,21 +167,46 @@ int main(int argc, char **argv) {
     gmp_printf("e - public exponent (%d bits): %Zd\n", mpz_sizeinbase(e, 2), e);
   }
 
-  mpz_set_str(username, userid, 62); // convert  username to mpz_t
-  if (!rsa_verify(username, s, e,
+  if (mpz_set_str(username, userid, 62) != 0 || // convert username to mpz_t
+      !rsa_verify(username, s, e,
                   n)) { // verify signature and if signature is not verified
     fprintf(stderr, "Error: Cannot be verified\n"); // print error msg
-    mpz_clears(n, e, s, username, NULL);            // clear mpz vars
+    mpz_clears(pn, pe, ps, username, NULL);         // clear mpz vars
+    free(userbuf);
+    keycache_unmap(&kc);
     fclose(infile);
     fclose(outfile);
     fclose(pbfile); // close files
-    return 1;       // return non zero exit code
+    if (outpath != NULL) {
+      unlink(outpath); // don't leave an empty output behind
+    }
+    return 1; // return non zero exit code
   }
 
-  rsa_encrypt_file(infile, outfile, n, e); // encrypt file
+  rsa_error_t err;
+  bool ok = rsa_encrypt_file(infile, outfile, n, e, threads, format,
+                             &err); // encrypt file
+  if (stats_enabled) {
+    stats_print(stderr, stats_json);
+  }
+  if (!ok) {
+    fprintf(stderr, "Error: %s\n", err.reason);
+    fclose(infile);
+    fclose(outfile);
+    fclose(pbfile);
+    if (outpath != NULL) {
+      unlink(outpath); // nothing was written
+    }
+    mpz_clears(pn, pe, ps, username, NULL);
+    free(userbuf);
+    keycache_unmap(&kc);
+    return 1;
+  }
   fclose(infile);
   fclose(outfile);
   fclose(pbfile);
-  mpz_clears(n, e, s, username, NULL); // close files and clear mpz vars used
+  mpz_clears(pn, pe, ps, username, NULL); // close files and clear mpz vars
+  free(userbuf);
+  keycache_unmap(&kc);
   return 0;
 }
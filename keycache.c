@@ -0,0 +1,335 @@
+#include "keycache.h"
+// clang-format off
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+// clang-format on
+
+#define KC_MAGIC   "RSAK"     // first bytes of a compiled key file
+#define KC_VERSION 2          // version 2 adds the primes of multi-prime keys
+#define KC_ORDER   0x01020304 // written natively to detect the byte order
+#define KC_PRIV    1          // flag: the file holds a private key
+#define KC_CRT     2          // flag: p, q and the CRT components are valid
+#define KC_ALIGN   8          // alignment of every section
+#define KC_EXTRA   (RSA_MAX_PRIMES - 2) // primes after p and q
+#define KC_MODULI  (RSA_MAX_PRIMES + 1) // n and every prime
+
+// sections of a compiled key file; limb arrays except for KC_USER
+enum {
+  KC_N,    // modulus
+  KC_E,    // public exponent
+  KC_S,    // signature
+  KC_USER, // NUL terminated username
+  KC_D,    // private exponent
+  KC_P,
+  KC_Q,
+  KC_DP,
+  KC_DQ,
+  KC_QINV,
+  KC_R,                   // extra primes r_3 ..., one section each
+  KC_DR = KC_R + KC_EXTRA, // d mod (r_i - 1)
+  KC_RINV = KC_DR + KC_EXTRA,
+  KC_R2N = KC_RINV + KC_EXTRA, // R^2 mod n, padded to the limbs of n
+  KC_R2P,                      // R^2 mod p
+  KC_R2Q,                      // R^2 mod q
+  KC_R2R,                      // R^2 mod r_i
+  KC_SECTIONS = KC_R2R + KC_EXTRA
+};
+
+// section offset and size, in limbs or for KC_USER in bytes
+typedef struct {
+  uint64_t off;
+  uint64_t size;
+} kc_section_t;
+
+// the header at the start of a compiled key file, in native byte order
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t limb_bytes; // sizeof(mp_limb_t) of the writer
+  uint32_t order;      // KC_ORDER as the writer stores it
+  uint32_t flags;
+  uint32_t sections; // KC_SECTIONS
+  uint32_t nprimes;  // primes of a private key with KC_CRT
+  uint32_t reserved;
+  uint64_t nbits;
+  uint64_t k;
+  uint64_t ninv[KC_MODULI]; // -m^-1 mod 2^GMP_NUMB_BITS for m = n, p, q, r_i
+  kc_section_t sect[KC_SECTIONS];
+} kc_header_t;
+
+// the contents of one section while writing
+typedef struct {
+  const void *data;
+  size_t bytes;
+} kc_blob_t;
+
+// returns the padding that aligns off to KC_ALIGN
+static size_t kc_pad(size_t off) {
+  return (KC_ALIGN - off % KC_ALIGN) % KC_ALIGN;
+}
+
+// writes the header and every non-empty blob, each at an aligned offset
+static bool kc_write(FILE *f, kc_header_t *h, kc_blob_t *blobs) {
+  size_t off = sizeof(kc_header_t);
+  for (int i = 0; i < KC_SECTIONS; i++) {
+    off += kc_pad(off);
+    h->sect[i].off = off;
+    h->sect[i].size =
+        i == KC_USER ? blobs[i].bytes : blobs[i].bytes / sizeof(mp_limb_t);
+    off += blobs[i].bytes;
+  }
+  static const uint8_t zeros[KC_ALIGN];
+  bool ok = fwrite(h, sizeof(kc_header_t), 1, f) == 1;
+  off = sizeof(kc_header_t);
+  for (int i = 0; i < KC_SECTIONS && ok; i++) {
+    size_t pad = kc_pad(off);
+    ok = fwrite(zeros, 1, pad, f) == pad &&
+         fwrite(blobs[i].data, 1, blobs[i].bytes, f) == blobs[i].bytes;
+    off += pad + blobs[i].bytes;
+  }
+  return fflush(f) == 0 && ok;
+}
+
+// describes the limbs of x as a blob
+static kc_blob_t kc_limbs(mpz_t x) {
+  kc_blob_t b = { mpz_limbs_read(x), mpz_size(x) * sizeof(mp_limb_t) };
+  return b;
+}
+
+// fills in the fields shared by public and private headers
+static void kc_header(kc_header_t *h, mpz_t n, uint32_t flags) {
+  memset(h, 0, sizeof(kc_header_t));
+  memcpy(h->magic, KC_MAGIC, 4);
+  h->version = KC_VERSION;
+  h->limb_bytes = sizeof(mp_limb_t);
+  h->order = KC_ORDER;
+  h->flags = flags;
+  h->sections = KC_SECTIONS;
+  h->nbits = mpz_sizeinbase(n, 2);
+  h->k = (h->nbits - 1) / 8; // as computed by rsa_encrypt_file
+}
+
+// computes the montgomery constants of odd m into blobs[sect] and ninv;
+// r2 must hold mpz_size(m) limbs
+static void kc_mont(kc_blob_t *blobs, int sect, uint64_t *ninv, mp_limb_t *r2,
+                    mpz_t m) {
+  if (mpz_even_p(m) || mpz_cmp_ui(m, 1) <= 0) {
+    return; // left empty; readers fall back to computing without it
+  }
+  nt_mont_t mont;
+  nt_mont_set(&mont, r2, m);
+  *ninv = mont.ninv;
+  blobs[sect].data = r2;
+  blobs[sect].bytes = mpz_size(m) * sizeof(mp_limb_t);
+}
+
+// writes a public key as a compiled key file
+bool keycache_write_pub(FILE *f, mpz_t n, mpz_t e, mpz_t s,
+                        const char *username) {
+  kc_header_t h;
+  kc_header(&h, n, 0);
+  kc_blob_t blobs[KC_SECTIONS] = { { NULL, 0 } };
+  blobs[KC_N] = kc_limbs(n);
+  blobs[KC_E] = kc_limbs(e);
+  blobs[KC_S] = kc_limbs(s);
+  blobs[KC_USER].data = username;
+  blobs[KC_USER].bytes = strlen(username) + 1;
+  mp_limb_t *r2 = (mp_limb_t *)malloc((mpz_size(n) + 1) * sizeof(mp_limb_t));
+  kc_mont(blobs, KC_R2N, &h.ninv[0], r2, n);
+  bool ok = kc_write(f, &h, blobs);
+  free(r2);
+  return ok;
+}
+
+// writes a private key as a compiled key file
+bool keycache_write_priv(FILE *f, rsa_priv_t *key) {
+  kc_header_t h;
+  kc_header(&h, key->n, KC_PRIV | (key->crt ? KC_CRT : 0));
+  h.nprimes = key->crt ? key->nprimes : 0;
+  kc_blob_t blobs[KC_SECTIONS] = { { NULL, 0 } };
+  blobs[KC_N] = kc_limbs(key->n);
+  blobs[KC_D] = kc_limbs(key->d);
+  // R^2 mod n, then mod every prime; each prime adds at most one limb more
+  // than its share of n
+  mp_limb_t *r2 = (mp_limb_t *)malloc(
+      (2 * mpz_size(key->n) + RSA_MAX_PRIMES) * sizeof(mp_limb_t));
+  kc_mont(blobs, KC_R2N, &h.ninv[0], r2, key->n);
+  if (key->crt) {
+    blobs[KC_P] = kc_limbs(key->p);
+    blobs[KC_Q] = kc_limbs(key->q);
+    blobs[KC_DP] = kc_limbs(key->dp);
+    blobs[KC_DQ] = kc_limbs(key->dq);
+    blobs[KC_QINV] = kc_limbs(key->qinv);
+    mp_limb_t *r2p = r2 + mpz_size(key->n);
+    kc_mont(blobs, KC_R2P, &h.ninv[1], r2p, key->p);
+    r2p += mpz_size(key->p);
+    kc_mont(blobs, KC_R2Q, &h.ninv[2], r2p, key->q);
+    r2p += mpz_size(key->q);
+    for (uint32_t i = 0; i + 2 < key->nprimes; i++) {
+      blobs[KC_R + i] = kc_limbs(key->r[i]);
+      blobs[KC_DR + i] = kc_limbs(key->dr[i]);
+      blobs[KC_RINV + i] = kc_limbs(key->rinv[i]);
+      kc_mont(blobs, KC_R2R + i, &h.ninv[3 + i], r2p, key->r[i]);
+      r2p += mpz_size(key->r[i]);
+    }
+  }
+  bool ok = kc_write(f, &h, blobs);
+  free(r2);
+  return ok;
+}
+
+// returns whether f starts with the compiled key magic
+bool keycache_probe(FILE *f) {
+  char magic[4];
+  return pread(fileno(f), magic, 4, 0) == 4 &&
+         memcmp(magic, KC_MAGIC, 4) == 0;
+}
+
+// points x at the limbs of section i of a mapped file
+static void kc_view(mpz_t x, keycache_t *kc, kc_header_t *h, int i) {
+  const mp_limb_t *limbs = (const mp_limb_t *)((uint8_t *)kc->base +
+                                               h->sect[i].off);
+  mpz_roinit_n(x, limbs, (mp_size_t)h->sect[i].size);
+}
+
+// checks montgomery section r2 of modulus m against R^2 mod m recomputed
+// once, and fills in mont[idx]
+static bool kc_mont_load(keycache_t *kc, kc_header_t *h, int r2, int idx,
+                         mpz_t m) {
+  if (h->sect[r2].size == 0) {
+    return true; // not precomputed, contexts compute their own
+  }
+  mp_size_t nn = mpz_size(m);
+  if (mpz_even_p(m) || (mp_size_t)h->sect[r2].size != nn ||
+      (mp_limb_t)(mpz_getlimbn(m, 0) * h->ninv[idx]) != (mp_limb_t)-1) {
+    return false;
+  }
+  const mp_limb_t *r2p =
+      (const mp_limb_t *)((uint8_t *)kc->base + h->sect[r2].off);
+  mpz_t want, got; // a wrong r2 would silently corrupt every product
+  mpz_init(want);
+  mpz_setbit(want, 2 * nn * GMP_NUMB_BITS);
+  mpz_mod(want, want, m); // r2 = R^2 mod m, one division per map
+  bool ok = mpz_cmp(want, mpz_roinit_n(got, r2p, nn)) == 0;
+  mpz_clear(want);
+  if (!ok) {
+    return false;
+  }
+  nt_mont_t *mont = &kc->mont[idx];
+  mont->np = mpz_limbs_read(m);
+  mont->r2 = r2p;
+  mont->nn = nn;
+  mont->ninv = (mp_limb_t)h->ninv[idx];
+  return true;
+}
+
+// validates the header and sections of a mapped file and builds the views
+static bool kc_load(keycache_t *kc) {
+  kc_header_t *h = (kc_header_t *)kc->base;
+  if (kc->size < sizeof(kc_header_t) || memcmp(h->magic, KC_MAGIC, 4) != 0 ||
+      h->version != KC_VERSION || h->limb_bytes != sizeof(mp_limb_t) ||
+      h->order != KC_ORDER || h->sections != KC_SECTIONS) {
+    return false;
+  }
+  for (int i = 0; i < KC_SECTIONS; i++) {
+    uint64_t unit = i == KC_USER ? 1 : sizeof(mp_limb_t);
+    kc_section_t *s = &h->sect[i];
+    if (s->off % KC_ALIGN != 0 || s->off > kc->size ||
+        s->size > (kc->size - s->off) / unit) {
+      return false;
+    }
+  }
+  kc->priv = (h->flags & KC_PRIV) != 0;
+  kc->nbits = h->nbits;
+  kc->k = h->k;
+  kc_view(kc->n, kc, h, KC_N);
+  if (mpz_sizeinbase(kc->n, 2) != h->nbits || h->nbits < 9 ||
+      h->k != (h->nbits - 1) / 8) {
+    return false;
+  }
+  if (!kc->priv) {
+    const char *user = (const char *)kc->base + h->sect[KC_USER].off;
+    if (h->sect[KC_USER].size == 0 ||
+        user[h->sect[KC_USER].size - 1] != '\0') {
+      return false;
+    }
+    kc->username = user;
+    kc_view(kc->e, kc, h, KC_E);
+    kc_view(kc->s, kc, h, KC_S);
+    return kc_mont_load(kc, h, KC_R2N, 0, kc->n);
+  }
+  rsa_priv_t *key = &kc->key;
+  kc_view(key->n, kc, h, KC_N);
+  kc_view(key->d, kc, h, KC_D);
+  kc_view(key->p, kc, h, KC_P);
+  kc_view(key->q, kc, h, KC_Q);
+  kc_view(key->dp, kc, h, KC_DP);
+  kc_view(key->dq, kc, h, KC_DQ);
+  kc_view(key->qinv, kc, h, KC_QINV);
+  for (int i = 0; i < KC_EXTRA; i++) {
+    kc_view(key->r[i], kc, h, KC_R + i);
+    kc_view(key->dr[i], kc, h, KC_DR + i);
+    kc_view(key->rinv[i], kc, h, KC_RINV + i);
+  }
+  key->crt = (h->flags & KC_CRT) != 0;
+  key->nprimes = key->crt ? h->nprimes : 2;
+  if (key->nprimes < 2 || key->nprimes > RSA_MAX_PRIMES ||
+      !kc_mont_load(kc, h, KC_R2N, 0, key->n)) {
+    return false;
+  }
+  if (!key->crt) {
+    return true;
+  }
+  mpz_t t;
+  mpz_init(t);
+  mpz_mul(t, key->p, key->q);
+  bool ok = kc_mont_load(kc, h, KC_R2P, 1, key->p) &&
+            kc_mont_load(kc, h, KC_R2Q, 2, key->q);
+  for (uint32_t i = 0; i + 2 < key->nprimes && ok; i++) {
+    mpz_mul(t, t, key->r[i]);
+    ok = kc_mont_load(kc, h, KC_R2R + i, 3 + i, key->r[i]);
+  }
+  ok = ok && mpz_cmp(t, key->n) == 0; // as checked for text keys
+  mpz_clear(t);
+  return ok;
+}
+
+// maps a compiled key file and shares its montgomery constants
+bool keycache_map(keycache_t *kc, FILE *f) {
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0 || st.st_size <= 0) {
+    return false;
+  }
+  kc->size = st.st_size;
+  kc->base = mmap(NULL, kc->size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+  if (kc->base == MAP_FAILED) {
+    kc->base = NULL;
+    return false;
+  }
+  memset(kc->mont, 0, sizeof(kc->mont));
+  if (!kc_load(kc)) {
+    keycache_unmap(kc);
+    return false;
+  }
+  for (int i = 0; i < KC_MODULI; i++) { // shared once the file checks out
+    if (kc->mont[i].np != NULL && !nt_mont_share(&kc->mont[i])) {
+      keycache_unmap(kc);
+      return false;
+    }
+  }
+  return true;
+}
+
+// unshares the montgomery constants of a compiled key file and unmaps it
+void keycache_unmap(keycache_t *kc) {
+  if (kc->base != NULL) {
+    for (int i = 0; i < KC_MODULI; i++) {
+      nt_mont_unshare(&kc->mont[i]);
+    }
+    munmap(kc->base, kc->size);
+    kc->base = NULL;
+  }
+}
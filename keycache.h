@@ -0,0 +1,93 @@
+#pragma once
+
+// clang-format off
+#include <stdio.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "numtheory.h"
+#include "rsa.h"
+// clang-format on
+
+//
+// A compiled key file mapped into memory. The key components are read-only
+// views of the mapped limbs, so a tool can start exponentiating without
+// parsing hex or computing its montgomery constants. Cache files hold native
+// limbs and are only readable on machines with the same limb size and byte
+// order as the one that wrote them.
+//
+// base: the mapped file.
+// size: bytes in base.
+// priv: true if the file holds a private key, false for a public key.
+// nbits: bits in n.
+// k: the bytes per plaintext block that rsa_encrypt_file uses for n.
+// n, e, s: the modulus, exponent and signature of a public key.
+// username: the signed username of a public key.
+// key: the components of a private key; must not be rsa_priv_clear()ed.
+// mont: the montgomery constants of n, p, q and the extra primes, shared
+//       with nt_mont_share.
+//
+typedef struct {
+  void *base;
+  size_t size;
+  bool priv;
+  uint64_t nbits;
+  uint64_t k;
+  mpz_t n, e, s;
+  const char *username;
+  rsa_priv_t key;
+  nt_mont_t mont[RSA_MAX_PRIMES + 1];
+} keycache_t;
+
+//
+// Writes a public key as a compiled key file.
+// All mpz_t arguments are expected to be initialized.
+//
+// f: the file to write to.
+// n: the public modulus.
+// e: the public exponent.
+// s: the signature of the username.
+// username: the username that was signed as s.
+// returns: true if the file was written, false on a write error.
+//
+bool keycache_write_pub(FILE *f, mpz_t n, mpz_t e, mpz_t s,
+                        const char *username);
+
+//
+// Writes a private key as a compiled key file.
+//
+// f: the file to write to.
+// key: the private key to write.
+// returns: true if the file was written, false on a write error.
+//
+bool keycache_write_priv(FILE *f, rsa_priv_t *key);
+
+//
+// Returns whether a file starts like a compiled key file, without moving
+// its read position.
+//
+// f: the open key file.
+//
+bool keycache_probe(FILE *f);
+
+//
+// Maps a compiled key file and shares its montgomery constants with every
+// numtheory context prepared later. Must be called before other threads use
+// numtheory, and kc must stay mapped while they use its key.
+//
+// kc: will describe the mapped key.
+// f: the open key file.
+// returns: true if the file was mapped, false if it is malformed, was
+//          written on an incompatible machine or its constants can't be
+//          shared.
+//
+bool keycache_map(keycache_t *kc, FILE *f);
+
+//
+// Stops sharing the montgomery constants of a compiled key file and unmaps
+// it. No thread may still be using its key.
+//
+// kc: the mapped key.
+//
+void keycache_unmap(keycache_t *kc);
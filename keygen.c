@@ -3,58 +3,303 @@
 #include <gmp.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <string.h>
 #include "numtheory.h"
+#include "pool.h"
+#include "primepool.h"
 #include "randstate.h"
 #include "rsa.h"
+#include "stats.h"
 // clang-format on
 
-#define OPTIONS "hb:i:n:d:s:v"
+#define OPTIONS "hb:i:n:d:s:e:t:k:P:N:u:o:v"
+#define OPT_STATS 256 // --stats has no short form
+
+static const struct option long_options[] = {
+  { "stats", optional_argument, NULL, OPT_STATS },
+  { NULL, 0, NULL, 0 },
+};
+
+// prints the program synopsis and usage
+static void usage(void) {
+  fprintf(stderr, "Usage: ./keygen [options]\n");
+  fprintf(stderr, "  ./keygen generates a public / private key pair, "
+                  "placing the keys into the public and private\n");
+  fprintf(stderr, "  key files as specified below. The keys have a modulus "
+                  "(n) whose length is specified in\n");
+  fprintf(stderr, "  the program options.\n");
+  fprintf(stderr, "    -s <seed>   : Use <seed> as the random number seed. "
+                  "Default: time()\n");
+  fprintf(stderr, "    -b <bits>   : Public modulus n must have at least "
+                  "<bits> bits. Default: 1024\n");
+  fprintf(stderr, "    -i <iters>  : Run <iters> Miller-Rabin iterations "
+                  "for primality testing. Default: 50\n");
+  fprintf(stderr,
+          "    -n <pbfile> : Public key file is <pbfile>. Default: rsa.pub\n");
+  fprintf(stderr, "    -d <pvfile> : Private key file is <pvfile>. "
+                  "Default: rsa.priv\n");
+  fprintf(stderr, "    -e <exp>    : Use <exp> as the public exponent, or "
+                  "0 for a random one. Default: 65537\n");
+  fprintf(stderr, "    -t <threads>: Search for primes with <threads> "
+                  "threads. Default: 1, or\n");
+  fprintf(stderr, "                  online CPUs with -N\n");
+  fprintf(stderr, "    -k <primes> : Make n the product of <primes> balanced "
+                  "primes, 2 to %d.\n", RSA_MAX_PRIMES);
+  fprintf(stderr, "                  Default: 2\n");
+  fprintf(stderr, "    -P <pool>   : Take primes from the primegen pool "
+                  "<pool>, generating any it lacks.\n");
+  fprintf(stderr, "    -N <count>  : Make <count> key pairs, one for each of "
+                  "the first <count>\n");
+  fprintf(stderr, "                  usernames in the -u file, with -t "
+                  "keys made at once.\n");
+  fprintf(stderr, "    -u <users>  : Read usernames from <users>, one per "
+                  "line. Default: stdin\n");
+  fprintf(stderr, "    -o <dir>    : With -N, write <user>.pub and "
+                  "<user>.priv into <dir>. Default: .\n");
+  fprintf(stderr, "    -v          : Enable verbose output.\n");
+  fprintf(stderr, "    --stats[=json]: Print counters and timings to "
+                  "stderr when done.\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
+
+// settings and results of a bulk run, one key pair per username
+typedef struct {
+  char **names;
+  uint64_t count;
+  const char *dir;
+  uint64_t nbits;
+  uint64_t iters;
+  uint64_t pubexp;
+  uint32_t nprimes;
+  const char *primepool;
+  mpz_t *pooled;     // with -P, the primes drawn for key i start at i nprimes
+  uint32_t *npooled; // the number of primes drawn for each key
+  const randstate_t *rs; // key i draws from stream i split from rs
+  bool *failed;
+} bulk_t;
+
+// compares two usernames for qsort
+static int cmp_name(const void *x, const void *y) {
+  return strcmp(*(char *const *)x, *(char *const *)y);
+}
+
+// reads the first count usernames, one per line, from users into b;
+// returns false after reporting a short list or an unusable username
+static bool bulk_read_names(bulk_t *b, FILE *users) {
+  b->names = (char **)calloc(b->count + 1, sizeof(char *));
+  char line[4096];
+  uint64_t got = 0, lineno = 0;
+  while (got < b->count && fgets(line, sizeof(line), users) != NULL) {
+    lineno++;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0') {
+      continue; // blank lines are not identities
+    }
+    for (char *c = line; *c != '\0'; c++) { // signed in base 62, and a name
+      if (!isalnum((unsigned char)*c)) {    // that is a safe file name
+        fprintf(stderr, "line %" PRIu64 ": username must be letters and "
+                        "digits only\n", lineno);
+        return false;
+      }
+    }
+    b->names[got++] = strdup(line);
+  }
+  if (got < b->count) {
+    fprintf(stderr, "only %" PRIu64 " usernames for %" PRIu64 " keys\n", got,
+            b->count);
+    return false;
+  }
+  char **sorted = (char **)malloc(b->count * sizeof(char *));
+  memcpy(sorted, b->names, b->count * sizeof(char *));
+  qsort(sorted, b->count, sizeof(char *), cmp_name);
+  bool unique = true;
+  for (uint64_t i = 1; i < b->count && unique; i++) {
+    unique = strcmp(sorted[i - 1], sorted[i]) != 0;
+    if (!unique) {
+      fprintf(stderr, "%s: username listed twice\n", sorted[i]);
+    }
+  }
+  free(sorted);
+  return unique;
+}
+
+// opens dir/name.ext for writing, readable by the user only if private
+static FILE *bulk_open(const char *dir, const char *name, const char *ext,
+                       bool private) {
+  char path[8192];
+  snprintf(path, sizeof(path), "%s/%s.%s", dir, name, ext);
+  if (!private) {
+    return fopen(path, "w");
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    return NULL;
+  }
+  fchmod(fd, 0600); // an existing file keeps its mode through O_CREAT
+  FILE *f = fdopen(fd, "w");
+  if (f == NULL) {
+    close(fd);
+  }
+  return f;
+}
+
+// makes and writes the key pair of username i of a bulk_t (run on a pool
+// worker). the key depends only on the seed and i, from random stream i
+static void bulk_job(void *arg, uint64_t i, uint32_t worker) {
+  (void)worker;
+  bulk_t *b = (bulk_t *)arg;
+  mpz_t primes[RSA_MAX_PRIMES], n, e, d, username, s;
+  mpz_inits(n, e, d, username, s, NULL);
+  for (uint32_t j = 0; j < b->nprimes; j++) {
+    mpz_init(primes[j]);
+  }
+  uint64_t start = stats_start();
+  randstate_t rs;
+  randstate_split(&rs, b->rs, i);
+  if (b->pooled != NULL) { // start from the pool primes drawn for key i
+    for (uint32_t j = 0; j < b->npooled[i]; j++) {
+      mpz_swap(primes[j], b->pooled[i * b->nprimes + j]);
+    }
+    rsa_make_pub_given(primes, b->npooled[i], b->nprimes, n, e, b->nbits,
+                       b->iters, b->pubexp, 1, &rs);
+  } else {
+    rsa_make_pub_multi(primes, b->nprimes, n, e, b->nbits, b->iters,
+                       b->pubexp, 1, NULL, &rs);
+  }
+  randstate_clear(&rs);
+  rsa_make_priv_multi(d, e, primes, b->nprimes);
+  rsa_priv_t priv;
+  rsa_priv_init(&priv);
+  rsa_priv_set_multi(&priv, n, d, primes, b->nprimes);
+  mpz_set_str(username, b->names[i], 62);
+  rsa_sign(s, username, &priv);
+  stats_stop(STAT_MATH, start);
+  start = stats_start();
+  FILE *pbfile = bulk_open(b->dir, b->names[i], "pub", false);
+  FILE *pvfile = bulk_open(b->dir, b->names[i], "priv", true);
+  b->failed[i] = pbfile == NULL || pvfile == NULL;
+  if (!b->failed[i]) {
+    rsa_write_pub(n, e, s, b->names[i], pbfile);
+    rsa_write_priv(&priv, pvfile);
+  }
+  if (pbfile != NULL) {
+    b->failed[i] = fclose(pbfile) != 0 || b->failed[i];
+  }
+  if (pvfile != NULL) {
+    b->failed[i] = fclose(pvfile) != 0 || b->failed[i];
+  }
+  stats_stop(STAT_IO, start);
+  stats_add(STAT_BLOCKS, 1);
+  mpz_clears(n, e, d, username, s, NULL);
+  for (uint32_t j = 0; j < b->nprimes; j++) {
+    mpz_clear(primes[j]);
+  }
+  rsa_priv_clear(&priv);
+}
+
+// takes the primes of every key from the pool of a bulk_t in key order
+// before any key is made, so which worker makes a key does not change it.
+// a key stops drawing at the first size the pool lacks
+static void bulk_draw(bulk_t *b) {
+  uint64_t sizes[RSA_MAX_PRIMES];
+  rsa_prime_sizes(sizes, b->nbits, b->nprimes);
+  mpz_t e; // pool primes must suit a fixed public exponent
+  mpz_init_set_ui(e, b->pubexp);
+  b->pooled = (mpz_t *)malloc(b->count * b->nprimes * sizeof(mpz_t));
+  b->npooled = (uint32_t *)calloc(b->count + 1, sizeof(uint32_t));
+  for (uint64_t i = 0; i < b->count; i++) {
+    mpz_t *p = b->pooled + i * b->nprimes;
+    for (uint32_t j = 0; j < b->nprimes; j++) {
+      mpz_init(p[j]);
+    }
+    uint32_t *got = &b->npooled[i];
+    while (*got < b->nprimes &&
+           primepool_take(b->primepool, p[*got], sizes[*got],
+                          b->pubexp != 0 ? e : NULL)) {
+      (*got)++;
+    }
+  }
+  mpz_clear(e);
+}
+
+// makes the key pairs of a bulk_t on threads workers; returns the number of
+// pairs that couldn't be written
+static uint64_t bulk_run(bulk_t *b, uint32_t threads, bool verbose) {
+  b->failed = (bool *)calloc(b->count + 1, sizeof(bool));
+  if (b->primepool != NULL) {
+    bulk_draw(b);
+  }
+  pool_t *pool = threads > 1 ? pool_create(threads) : NULL;
+  if (pool != NULL) { // workers take the next username as they finish
+    pool_run(pool, bulk_job, b, b->count);
+    pool_delete(&pool);
+  } else {
+    for (uint64_t i = 0; i < b->count; i++) {
+      bulk_job(b, i, 0);
+    }
+  }
+  uint64_t failed = 0;
+  for (uint64_t i = 0; i < b->count; i++) {
+    if (b->failed[i]) {
+      fprintf(stderr, "%s/%s: key pair couldn't be written\n", b->dir,
+              b->names[i]);
+      failed++;
+    } else if (verbose) {
+      fprintf(stderr, "%s/%s.pub, %s/%s.priv\n", b->dir, b->names[i], b->dir,
+              b->names[i]);
+    }
+  }
+  if (b->pooled != NULL) {
+    for (uint64_t i = 0; i < b->count * b->nprimes; i++) {
+      mpz_clear(b->pooled[i]);
+    }
+    free(b->pooled);
+    free(b->npooled);
+  }
+  free(b->failed);
+  return failed;
+}
 
 int main(int argc, char **argv) {
-  FILE *pbfile;
-  FILE *pvfile;
+  FILE *pbfile = NULL;
+  FILE *pvfile = NULL;
   uint64_t nbits =
       1024;            // default number of bits needed for public mod n = 1024
   uint64_t iters = 50; // default iters for testing primes = 50
   uint32_t seed = time(NULL); // default seed = time(NULL)
+  uint64_t pubexp = 65537;    // default public exponent = 65537
+  uint32_t threads = 0;       // default threads = 1, or online CPUs with -N
+  uint32_t nprimes = 2;       // default primes in n = 2
+  const char *primepool = NULL; // default is to generate every prime
   bool verbose = false;       // default for verbose output = false
+  bool stats_json = false; // print --stats as JSON instead of text
   bool user_set_pbfile = false;
   bool user_set_pvfile = false;
+  uint64_t count = 0;          // default is one key pair for $USER
+  FILE *users = stdin;         // usernames for -N
+  const char *outdir = ".";    // directory of the -N key pairs
   int64_t opt = 0;
-  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+  while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) !=
+         -1) {
     switch (opt) {
     case 'h': // print help msg and return successful exit code
-      fprintf(stderr, "Usage: ./keygen [options]\n");
-      fprintf(stderr, "  ./keygen generates a public / private key pair, "
-                      "placing the keys into the public and private\n");
-      fprintf(stderr, "  key files as specified below. The keys have a modulus "
-                      "(n) whose length is specified in\n");
-      fprintf(stderr, "  the program options.\n");
-      fprintf(stderr, "    -s <seed>   : Use <seed> as the random number seed. "
-                      "Default: time()\n");
-      fprintf(stderr, "    -b <bits>   : Public modulus n must have at least "
-                      "<bits> bits. Default: 1024\n");
-      fprintf(stderr, "    -i <iters>  : Run <iters> Miller-Rabin iterations "
-                      "for primality testing. Default: 50\n");
-      fprintf(
-          stderr,
-          "    -n <pbfile> : Public key file is <pbfile>. Default: rsa.pub\n");
-
-      fprintf(stderr, "    -d <pvfile> : Private key file is <pvfile>. "
-                      "Default: rsa.priv\n");
-      fprintf(stderr, "    -v          : Enable verbose output.\n");
-      fprintf(stderr,
-              "    -h          : Display program synopsis and usage.\n");
+      usage();
       return 0;
     case 'b':
       nbits = strtoul(optarg, NULL, 10); // setting nbits to optarg
       break;
     case 'i':
       iters = strtoul(optarg, NULL, 10); // setting iters to optarg
+      break;
     case 'n':
       pbfile = fopen(optarg, "w+"); // open pbfile set by user
       if (pbfile == NULL) {         // if pbfile doesnt exist
@@ -74,34 +319,99 @@ int main(int argc, char **argv) {
     case 's':
       seed = strtoul(optarg, NULL, 10);
       break;
+    case 'e':
+      pubexp = strtoull(optarg, NULL, 10); // setting public exponent to optarg
+      if (pubexp != 0 && (pubexp < 3 || pubexp % 2 == 0)) {
+        fprintf(stderr, "public exponent must be odd and at least 3\n");
+        return 1;
+      }
+      break;
+    case 't':
+      threads = strtoul(optarg, NULL, 10); // setting threads to optarg
+      if (threads == 0) {
+        fprintf(stderr, "threads must be at least 1\n");
+        return 1;
+      }
+      break;
+    case 'k':
+      nprimes = strtoul(optarg, NULL, 10); // setting nprimes to optarg
+      if (nprimes < 2 || nprimes > RSA_MAX_PRIMES) {
+        fprintf(stderr, "primes must be between 2 and %d\n", RSA_MAX_PRIMES);
+        return 1;
+      }
+      break;
+    case 'P':
+      primepool = optarg;
+      break;
+    case 'N':
+      count = strtoull(optarg, NULL, 10);
+      if (count == 0) {
+        fprintf(stderr, "count must be at least 1\n");
+        return 1;
+      }
+      break;
+    case 'u':
+      if (users != stdin) {
+        fclose(users);
+      }
+      users = fopen(optarg, "r");
+      if (users == NULL) {
+        fprintf(stderr, "%s: couldn't be opened\n", optarg);
+        return 1;
+      }
+      break;
+    case 'o':
+      outdir = optarg;
+      break;
     case 'v':
       verbose = true;
       break;
+    case OPT_STATS:
+      if (!stats_parse_opt(optarg, &stats_json)) {
+        return 1;
+      }
+      break;
     default: // on bad arg print help msg and return non zero exit code
-      fprintf(stderr, "Usage: ./keygen [options]\n");
-      fprintf(stderr, "  ./keygen generates a public / private key pair, "
-                      "placing the keys into the public and private\n");
-      fprintf(stderr, "  key files as specified below. The keys have a modulus "
-                      "(n) whose length is specified in\n");
-      fprintf(stderr, "  the program options.\n");
-      fprintf(stderr, "    -s <seed>   : Use <seed> as the random number seed. "
-                      "Default: time()\n");
-      fprintf(stderr, "    -b <bits>   : Public modulus n must have at least "
-                      "<bits> bits. Default: 1024\n");
-      fprintf(stderr, "    -i <iters>  : Run <iters> Miller-Rabin iterations "
-                      "for primality testing. Default: 50\n");
-      fprintf(
-          stderr,
-          "    -n <pbfile> : Public key file is <pbfile>. Default: rsa.pub\n");
-
-      fprintf(stderr, "    -d <pvfile> : Private key file is <pvfile>. "
-                      "Default: rsa.priv\n");
-      fprintf(stderr, "    -v          : Enable verbose output.\n");
-      fprintf(stderr,
-              "    -h          : Display program synopsis and usage.\n");
+      usage();
       return 1;
     }
   }
+  if (count > 0) { // bulk mode: every pair to outdir, one per username
+    if (user_set_pbfile || user_set_pvfile) {
+      fprintf(stderr, "-n and -d can't be used with -N\n");
+      return 1;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads == 0) {
+      threads = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    randstate_t rs;
+    randstate_init(&rs, seed);
+    bulk_t b = { .count = count, .dir = outdir, .nbits = nbits,
+                 .iters = iters, .pubexp = pubexp, .nprimes = nprimes,
+                 .primepool = primepool, .rs = &rs };
+    bool ok = bulk_read_names(&b, users);
+    if (ok && mkdir(outdir, 0700) != 0 && errno != EEXIST) {
+      fprintf(stderr, "%s: directory couldn't be created\n", outdir);
+      ok = false;
+    }
+    uint64_t failed = ok ? bulk_run(&b, threads, verbose) : 0;
+    if (ok && stats_enabled) {
+      stats_print(stderr, stats_json);
+    }
+    randstate_clear(&rs);
+    for (uint64_t i = 0; i < count; i++) {
+      free(b.names[i]);
+    }
+    free(b.names);
+    if (users != stdin) {
+      fclose(users);
+    }
+    return ok && failed == 0 ? 0 : 1;
+  }
+  if (threads == 0) {
+    threads = 1;
+  }
   if (user_set_pbfile ==
       false) { // if user hasn't set pbfile open default pbfile
     pbfile = fopen("rsa.pub", "w+");
@@ -120,27 +430,49 @@ int main(int argc, char **argv) {
   }
   int pv = fileno(pvfile); // run fileno to identify pvfile
   fchmod(pv, 0600);        // set private key file permissions for user only
-  randstate_init(seed);    // initialize rand state and set seed
+  randstate_t rs;
+  randstate_init(&rs, seed); // initialize rand state and set seed
 
-  mpz_t p, q, n, e, d, username, s;
-  mpz_inits(p, q, n, e, d, username, s,
+  mpz_t primes[RSA_MAX_PRIMES], n, e, d, username, s;
+  mpz_inits(n, e, d, username, s,
             NULL); // initialize mpz vars for pub and priv keys
-  rsa_make_pub(p, q, n, e, nbits, iters); // make pub key
-  rsa_make_priv(d, e, p, q);              // make priv key
+  for (uint32_t i = 0; i < nprimes; i++) {
+    mpz_init(primes[i]);
+  }
+  uint64_t start = stats_start();
+  rsa_make_pub_multi(primes, nprimes, n, e, nbits, iters, pubexp, threads,
+                     primepool, &rs);              // make pub key
+  rsa_make_priv_multi(d, e, primes, nprimes); // make priv key
+  rsa_priv_t priv;
+  rsa_priv_init(&priv);
+  rsa_priv_set_multi(&priv, n, d, primes,
+                     nprimes); // precompute CRT components of priv key
 
   char *userid = getenv("USER"); // get current username's name as string
   mpz_set_str(username, userid,
               62);             // convert username into mpz with base of 62
-  rsa_sign(s, username, d, n); // computer signature of username
+  rsa_sign(s, username, &priv); // computer signature of username
+  stats_stop(STAT_MATH, start);
+  start = stats_start();
   rsa_write_pub(n, e, s, userid, pbfile); // write computed public key to pbfile
-  rsa_write_priv(n, d, pvfile); // write computed private key to pvfile
+  rsa_write_priv(&priv, pvfile); // write computed private key to pvfile
+  fflush(pbfile);
+  fflush(pvfile);
+  stats_stop(STAT_IO, start);
 
   if (verbose) { // if verbose output is enabled print
     fprintf(stderr, "username = %s\n", userid);
     gmp_fprintf(stderr, "user signature (%d bits): %Zd\n", mpz_sizeinbase(s, 2),
                 s);
-    gmp_fprintf(stderr, "p (%d bits): %Zd\n", mpz_sizeinbase(p, 2), p);
-    gmp_fprintf(stderr, "q (%d bits): %Zd\n", mpz_sizeinbase(q, 2), q);
+    for (uint32_t i = 0; i < nprimes; i++) {
+      if (i < 2) {
+        gmp_fprintf(stderr, "%c (%d bits): %Zd\n", i == 0 ? 'p' : 'q',
+                    mpz_sizeinbase(primes[i], 2), primes[i]);
+      } else {
+        gmp_fprintf(stderr, "r%u (%d bits): %Zd\n", i + 1,
+                    mpz_sizeinbase(primes[i], 2), primes[i]);
+      }
+    }
     gmp_fprintf(stderr, "n - modulus (%d bits): %Zd\n", mpz_sizeinbase(n, 2),
                 n);
     gmp_fprintf(stderr, "e - public exponent (%d bits): %Zd\n",
@@ -149,9 +481,16 @@ int main(int argc, char **argv) {
                 mpz_sizeinbase(d, 2), d);
   }
 
+  if (stats_enabled) {
+    stats_print(stderr, stats_json);
+  }
   fclose(pbfile);
   fclose(pvfile);
-  randstate_clear();
-  mpz_clears(p, q, n, e, d, username, s, NULL);
+  randstate_clear(&rs);
+  mpz_clears(n, e, d, username, s, NULL);
+  for (uint32_t i = 0; i < nprimes; i++) {
+    mpz_clear(primes[i]);
+  }
+  rsa_priv_clear(&priv);
   return 0;
 }
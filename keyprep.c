@@ -0,0 +1,146 @@
+// clang-format off
+#include <stdio.h>
+#include <gmp.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "keycache.h"
+#include "rsa.h"
+// clang-format on
+
+#define OPTIONS "i:o:dvh"
+
+// prints the program synopsis and usage
+static void usage(void) {
+  fprintf(stderr, "Usage: ./keyprep [options]\n");
+  fprintf(stderr, "  ./keyprep compiles a key file into a binary key file "
+                  "holding its limbs\n");
+  fprintf(stderr, "  and montgomery constants, which encrypt and decrypt "
+                  "accept with -n.\n");
+  fprintf(stderr, "  Compiled keys are only readable on machines like the "
+                  "one that wrote them.\n");
+  fprintf(stderr, "    -i <keyfile>: Key is in <keyfile>. Default: rsa.pub, "
+                  "or rsa.priv with -d.\n");
+  fprintf(stderr, "    -o <outfile>: Write the compiled key to <outfile>. "
+                  "Default: <keyfile>.k\n");
+  fprintf(stderr, "    -d          : The key is a private key.\n");
+  fprintf(stderr, "    -v          : Enable verbose output.\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
+
+// reads the public key in keyfile and writes it compiled to outfile
+static bool prep_pub(FILE *keyfile, FILE *outfile, bool verbose) {
+  struct stat st;
+  if (fstat(fileno(keyfile), &st) != 0) {
+    return false;
+  }
+  char *username = (char *)malloc(st.st_size + 1); // can't outgrow the file
+  mpz_t n, e, s;
+  mpz_inits(n, e, s, NULL);
+  bool ok = rsa_read_pub(n, e, s, username, keyfile) && mpz_sgn(n) > 0;
+  if (ok) {
+    ok = keycache_write_pub(outfile, n, e, s, username);
+    if (!ok) {
+      fprintf(stderr, "Error: Cannot write compiled key\n");
+    }
+  } else {
+    fprintf(stderr, "Error: Malformed public key file\n");
+  }
+  if (ok && verbose) {
+    printf("public key of %s, n has %zu bits, blocks of %zu bytes\n",
+           username, mpz_sizeinbase(n, 2), (mpz_sizeinbase(n, 2) - 1) / 8);
+  }
+  mpz_clears(n, e, s, NULL);
+  free(username);
+  return ok;
+}
+
+// reads the private key in keyfile and writes it compiled to outfile
+static bool prep_priv(FILE *keyfile, FILE *outfile, bool verbose) {
+  rsa_priv_t key;
+  rsa_priv_init(&key);
+  bool ok = rsa_read_priv(&key, keyfile) && mpz_sgn(key.n) > 0;
+  if (ok) {
+    fchmod(fileno(outfile), 0600); // as private as the key itself
+    ok = keycache_write_priv(outfile, &key);
+    if (!ok) {
+      fprintf(stderr, "Error: Cannot write compiled key\n");
+    }
+  } else {
+    fprintf(stderr, "Error: Malformed private key file\n");
+  }
+  if (ok && verbose) {
+    printf("private key, n has %zu bits, %s\n", mpz_sizeinbase(key.n, 2),
+           key.crt ? "with CRT components" : "legacy without CRT");
+  }
+  rsa_priv_clear(&key);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  const char *inpath = NULL;
+  const char *outpath = NULL;
+  bool priv = false;
+  bool verbose = false;
+  int32_t opt = 0;
+  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    switch (opt) {
+    case 'i':
+      inpath = optarg;
+      break;
+    case 'o':
+      outpath = optarg;
+      break;
+    case 'd':
+      priv = true;
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'h':
+      usage();
+      return 0;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (inpath == NULL) {
+    inpath = priv ? "rsa.priv" : "rsa.pub";
+  }
+  char *defpath = (char *)malloc(strlen(inpath) + 3);
+  sprintf(defpath, "%s.k", inpath);
+  if (outpath == NULL) {
+    outpath = defpath;
+  }
+
+  FILE *keyfile = fopen(inpath, "r");
+  if (keyfile == NULL) {
+    fprintf(stderr, "keyfile couldn't be opened\n");
+    free(defpath);
+    return 1;
+  }
+  FILE *outfile = fopen(outpath, "w");
+  if (outfile == NULL) {
+    fprintf(stderr, "outfile couldn't be opened\n");
+    fclose(keyfile);
+    free(defpath);
+    return 1;
+  }
+  bool ok = priv ? prep_priv(keyfile, outfile, verbose)
+                 : prep_pub(keyfile, outfile, verbose);
+  fclose(keyfile);
+  if (fclose(outfile) != 0 && ok) {
+    fprintf(stderr, "Error: Cannot write compiled key\n");
+    ok = false;
+  }
+  if (!ok) {
+    remove(outpath); // leave no partial key behind
+  }
+  free(defpath);
+  return ok ? 0 : 1;
+}
@@ -3,86 +3,718 @@
 #include <gmp.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "numtheory.h"
 #include "randstate.h"
+#include "stats.h"
 // clang-format on
 
+#if GMP_NAIL_BITS != 0
+#error "numtheory.c requires a nail-free GMP build"
+#endif
+
+// picks the sliding window width for an exponent with ebits bits
+static int window_bits(size_t ebits) {
+  if (ebits > 671) {
+    return 6;
+  } else if (ebits > 239) {
+    return 5;
+  } else if (ebits > 79) {
+    return 4;
+  } else if (ebits > 23) {
+    return 3;
+  } else if (ebits > 7) {
+    return 2;
+  }
+  return 1;
+}
+
+// reads the window of at most w bits of d whose top bit is the set bit i,
+// trimmed so that it ends in a set bit; returns its (odd) value and stores
+// its width in len
+static unsigned long window_at(mpz_t d, size_t i, int w, size_t *len) {
+  size_t low = i + 1 > (size_t)w ? i + 1 - w : 0; // lowest bit in window
+  while (mpz_tstbit(d, low) == 0) {               // window must end in a 1
+    low++;
+  }
+  unsigned long val = 0;
+  for (size_t b = i + 1; b-- > low;) {
+    val = (val << 1) | mpz_tstbit(d, b);
+  }
+  *len = i - low + 1;
+  return val;
+}
+
+// initializes an empty exponent plan
+void nt_exp_init(nt_exp_t *x) {
+  x->steps = NULL;
+  x->nsteps = 0;
+  x->cap = 0;
+  x->tsize = 0;
+  x->tail = 0;
+  x->squarings = 0;
+}
+
+// frees the memory used by an exponent plan
+void nt_exp_clear(nt_exp_t *x) {
+  free(x->steps);
+  nt_exp_init(x);
+}
+
+// recodes d into the sliding windows that pow_mod multiplies in
+void nt_exp_set(nt_exp_t *x, mpz_t d) {
+  x->nsteps = 0;
+  x->tsize = 0;
+  x->squarings = 0;
+  uint64_t pending = 0; // squarings owed before the next window
+  if (mpz_sgn(d) == 0) {
+    x->tail = 0;
+    return;
+  }
+  size_t ebits = mpz_sizeinbase(d, 2);
+  int w = window_bits(ebits);
+  size_t i = ebits;
+  while (i-- > 0) {
+    if (mpz_tstbit(d, i) == 0) { // zero bits only square
+      pending++;
+      continue;
+    }
+    size_t len;
+    unsigned long val = window_at(d, i, w, &len);
+    if (x->nsteps == x->cap) {
+      x->cap = x->cap > 0 ? 2 * x->cap : ebits / w + 1;
+      x->steps = realloc(x->steps, x->cap * sizeof(nt_step_t));
+    }
+    nt_step_t *step = &x->steps[x->nsteps];
+    step->squarings = x->nsteps > 0 ? pending + len : 0; // the first window
+    step->power = val >> 1;                               // starts from 1
+    if (step->power + 1 > x->tsize) {
+      x->tsize = step->power + 1;
+    }
+    x->squarings += step->squarings;
+    x->nsteps++;
+    pending = 0;
+    i -= len - 1;
+  }
+  x->tail = pending;
+  x->squarings += pending;
+}
+
+// montgomery reduction of the 2nn limb value tp into rp, computing
+// rp = tp / R mod n with R = 2^(nn * GMP_NUMB_BITS); tp is clobbered
+static void mont_redc(mp_limb_t *rp, mp_limb_t *tp, const mp_limb_t *np,
+                      mp_size_t nn, mp_limb_t ninv) {
+  for (mp_size_t i = 0; i < nn; i++) {
+    mp_limb_t q = tp[i] * ninv; // q makes tp[i] + q n[0] divisible by 2^64
+    tp[i] = mpn_addmul_1(tp + i, np, nn, q); // low limb is now zero, reuse it
+  }                                          // to hold the carry for tp[i + nn]
+  mp_limb_t cy = mpn_add_n(rp, tp + nn, tp, nn);
+  if (cy != 0 || mpn_cmp(rp, np, nn) >= 0) { // result is < 2n, subtract once
+    mpn_sub_n(rp, rp, np, nn);
+  }
+}
+
+// montgomery multiplication rp = ap * bp / R mod n using tp as 2nn scratch
+static void mont_mul(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp,
+                     mp_limb_t *tp, const mp_limb_t *np, mp_size_t nn,
+                     mp_limb_t ninv) {
+  if (ap == bp) {
+    mpn_sqr(tp, ap, nn);
+  } else {
+    mpn_mul_n(tp, ap, bp, nn);
+  }
+  mont_redc(rp, tp, np, nn, ninv);
+}
+
+// computes -n0^-1 mod 2^GMP_NUMB_BITS for odd n0 by newton iteration
+static mp_limb_t mont_ninv(mp_limb_t n0) {
+  mp_limb_t inv = n0; // correct to 3 bits since n0 * n0 = 1 mod 8
+  for (int i = 0; i < 5; i++) {
+    inv *= 2 - n0 * inv; // each step doubles the number of correct bits
+  }
+  return -inv;
+}
+
+// initializes a context with temporaries sized for bits bit operands
+void nt_ctx_init(nt_ctx_t *ctx, uint64_t bits) {
+  ctx->nlimbs = 0;
+  ctx->limbs = NULL;
+  mpz_ptr all[] = { ctx->t,  ctx->acc, ctx->sq, ctx->r,  ctx->a,
+                    ctx->y,  ctx->nsub1, ctx->r1, ctx->r2, ctx->t1,
+                    ctx->t2, ctx->q,   ctx->tmp };
+  for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+    if (bits > 0) {
+      mpz_init2(all[i], 2 * bits); // room for an unreduced product
+    } else {
+      mpz_init(all[i]);
+    }
+  }
+  for (size_t i = 0; i < NT_TABLE; i++) {
+    mpz_init(ctx->table[i]); // only needed for even moduli, grown on use
+  }
+  ctx->nmont = 0;
+  nt_exp_init(&ctx->exp);
+  if (bits > 0) {
+    mp_size_t nn = (bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+    ctx->nlimbs = (NT_TABLE + 4) * nn;
+    ctx->limbs = malloc(ctx->nlimbs * sizeof(mp_limb_t));
+  }
+}
+
+// frees the memory used by a context
+void nt_ctx_clear(nt_ctx_t *ctx) {
+  mpz_clears(ctx->t, ctx->acc, ctx->sq, ctx->r, ctx->a, ctx->y, ctx->nsub1,
+             ctx->r1, ctx->r2, ctx->t1, ctx->t2, ctx->q, ctx->tmp, NULL);
+  for (size_t i = 0; i < NT_TABLE; i++) {
+    mpz_clear(ctx->table[i]);
+  }
+  free(ctx->limbs);
+  ctx->limbs = NULL;
+  ctx->nlimbs = 0;
+  for (int i = 0; i < ctx->nmont; i++) {
+    free(ctx->owned[i]);
+  }
+  ctx->nmont = 0;
+  nt_exp_clear(&ctx->exp);
+}
+
+static const nt_mont_t **shared; // constants given to nt_mont_share
+static int nshared, shared_cap;
+
+// fills in the montgomery constants of odd n, storing R^2 mod n in r2
+void nt_mont_set(nt_mont_t *m, mp_limb_t *r2, mpz_t n) {
+  mp_size_t nn = mpz_size(n);
+  mpz_t t;
+  mpz_init(t);
+  mpz_setbit(t, 2 * nn * GMP_NUMB_BITS);
+  mpz_mod(t, t, n); // R^2 mod n
+  mpn_zero(r2, nn);
+  mpn_copyi(r2, mpz_limbs_read(t), mpz_size(t));
+  mpz_clear(t);
+  m->np = mpz_limbs_read(n);
+  m->r2 = r2;
+  m->nn = nn;
+  m->ninv = mont_ninv(m->np[0]);
+}
+
+// shares precomputed constants with later nt_ctx_prepare calls
+bool nt_mont_share(const nt_mont_t *m) {
+  if (nshared == shared_cap) {
+    int cap = shared_cap > 0 ? 2 * shared_cap : 8;
+    const nt_mont_t **grown = realloc(shared, cap * sizeof(*shared));
+    if (grown == NULL) {
+      return false;
+    }
+    shared = grown;
+    shared_cap = cap;
+  }
+  shared[nshared++] = m;
+  return true;
+}
+
+// stops sharing m, so limbs later mapped at the same address don't match it
+void nt_mont_unshare(const nt_mont_t *m) {
+  for (int i = 0; i < nshared; i++) {
+    if (shared[i] == m) {
+      shared[i--] = shared[--nshared];
+    }
+  }
+  if (nshared == 0) {
+    free(shared);
+    shared = NULL;
+    shared_cap = 0;
+  }
+}
+
+// prepares ctx to use montgomery constants for modulus n
+void nt_ctx_prepare(nt_ctx_t *ctx, mpz_t n) {
+  if (mpz_even_p(n) || mpz_cmp_ui(n, 1) <= 0 || ctx->nmont == NT_MONTS) {
+    return;
+  }
+  nt_mont_t *m = &ctx->mont[ctx->nmont];
+  ctx->owned[ctx->nmont] = NULL;
+  for (int i = 0; i < nshared; i++) {
+    if (shared[i]->np == mpz_limbs_read(n) &&
+        shared[i]->nn == (mp_size_t)mpz_size(n)) {
+      *m = *shared[i];
+      ctx->nmont++;
+      return;
+    }
+  }
+  mp_limb_t *r2 = malloc(mpz_size(n) * sizeof(mp_limb_t));
+  nt_mont_set(m, r2, n);
+  ctx->owned[ctx->nmont++] = r2;
+}
+
+// returns the prepared montgomery constants for n, or NULL
+static const nt_mont_t *ctx_mont(nt_ctx_t *ctx, mpz_t n) {
+  for (int i = 0; i < ctx->nmont; i++) {
+    if (ctx->mont[i].np == mpz_limbs_read(n) &&
+        ctx->mont[i].nn == (mp_size_t)mpz_size(n)) {
+      return &ctx->mont[i];
+    }
+  }
+  return NULL;
+}
+
+// sliding window exponentiation in montgomery form for odd n > 1
+static void pow_mod_mont(mpz_t o, mpz_t a, const nt_exp_t *x, mpz_t n,
+                         nt_ctx_t *ctx) {
+  const nt_mont_t *m = ctx_mont(ctx, n);
+  mp_size_t nn = mpz_size(n);
+  const mp_limb_t *np = mpz_limbs_read(n);
+  mp_limb_t ninv = m != NULL ? m->ninv : mont_ninv(np[0]);
+  size_t tsize = x->tsize; // odd powers a^1, a^3, ..., a^(2 tsize - 1)
+
+  size_t need = (tsize + 4) * nn;
+  if (ctx->nlimbs < need) {
+    free(ctx->limbs);
+    ctx->limbs = malloc(need * sizeof(mp_limb_t));
+    ctx->nlimbs = need;
+  }
+  mp_limb_t *table = ctx->limbs;
+  mp_limb_t *acc = table + tsize * nn;
+  mp_limb_t *tp = acc + nn; // 2nn limbs of product scratch
+  mp_limb_t *sq = tp + 2 * nn;
+
+  mpz_ptr t = ctx->t;
+  if (m != NULL) { // t = a R mod n by a montgomery product with R^2
+    if (mpz_sgn(a) < 0 || mpz_cmp(a, n) >= 0) {
+      mpz_mod(t, a, n);
+      a = t;
+    }
+    mpn_zero(sq, nn);
+    mpn_copyi(sq, mpz_limbs_read(a), mpz_size(a));
+    mont_mul(table, sq, m->r2, tp, np, nn, ninv);
+  } else {
+    mpz_mod(t, a, n);
+    mpz_mul_2exp(t, t, nn * GMP_NUMB_BITS);
+    mpz_mod(t, t, n); // t = a R mod n
+    mpn_zero(table, nn);
+    mpn_copyi(table, mpz_limbs_read(t), mpz_size(t));
+  }
+  if (tsize > 1) {
+    mont_mul(sq, table, table, tp, np, nn, ninv); // sq = a^2 R mod n
+  }
+  for (size_t i = 1; i < tsize; i++) {
+    mont_mul(table + i * nn, table + (i - 1) * nn, sq, tp, np, nn, ninv);
+  }
+
+  mpn_copyi(acc, table + x->steps[0].power * nn, nn); // no squaring of 1
+  for (size_t i = 1; i < x->nsteps; i++) {
+    for (uint32_t j = 0; j < x->steps[i].squarings; j++) {
+      mont_mul(acc, acc, acc, tp, np, nn, ninv);
+    }
+    mont_mul(acc, acc, table + x->steps[i].power * nn, tp, np, nn, ninv);
+  }
+  for (uint64_t j = 0; j < x->tail; j++) {
+    mont_mul(acc, acc, acc, tp, np, nn, ninv);
+  }
+
+  mpn_copyi(tp, acc, nn); // convert out of montgomery form: acc / R mod n
+  mpn_zero(tp + nn, nn);
+  mont_redc(acc, tp, np, nn, ninv);
+  mpn_copyi(mpz_limbs_write(o, nn), acc, nn);
+  mpz_limbs_finish(o, nn);
+  stats_add(STAT_SQUARINGS, x->squarings);
+}
+
+// sliding window exponentiation with division based reduction, for the even
+// moduli montgomery form cannot handle
+static void pow_mod_div(mpz_t o, mpz_t a, const nt_exp_t *x, mpz_t n,
+                        nt_ctx_t *ctx) {
+  size_t tsize = x->tsize;
+  mpz_t *table = ctx->table;
+  mpz_ptr acc = ctx->acc, sq = ctx->sq;
+  mpz_mod(table[0], a, n);
+  if (tsize > 1) {
+    mpz_mul(sq, table[0], table[0]);
+    mpz_mod(sq, sq, n);
+  }
+  for (size_t i = 1; i < tsize; i++) {
+    mpz_mul(table[i], table[i - 1], sq);
+    mpz_mod(table[i], table[i], n);
+  }
+
+  mpz_set(acc, table[x->steps[0].power]);
+  for (size_t i = 1; i < x->nsteps; i++) {
+    for (uint32_t j = 0; j < x->steps[i].squarings; j++) {
+      mpz_mul(sq, acc, acc);
+      mpz_mod(acc, sq, n);
+    }
+    mpz_mul(sq, acc, table[x->steps[i].power]);
+    mpz_mod(acc, sq, n);
+  }
+  for (uint64_t j = 0; j < x->tail; j++) {
+    mpz_mul(sq, acc, acc);
+    mpz_mod(acc, sq, n);
+  }
+  mpz_set(o, acc);
+  stats_add(STAT_SQUARINGS, x->squarings);
+}
+
 // computes a raised to d modulo n, stored in o
 void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
-  mpz_t v, p, dcopy;
-  mpz_init_set_ui(v, 1); // set v = 1
-  mpz_init_set(p, a);    // set p = a
-  mpz_init_set(dcopy, d);
-  while (mpz_cmp_ui(dcopy, 0) > 0) { // while d > 0
-    if (mpz_odd_p(dcopy) != 0) {     // if d is odd
-      mpz_mul(v, v, p);              // v = (v x p)
-      mpz_mod(v, v, n);              // v = v mod n
-    }
-    mpz_mul(p, p, p);               // p = (p x p)
-    mpz_mod(p, p, n);               // p = p mod n
-    mpz_fdiv_q_ui(dcopy, dcopy, 2); // d = d/2
+  nt_ctx_t ctx;
+  nt_ctx_init(&ctx, 0);
+  pow_mod_ctx(o, a, d, n, &ctx);
+  nt_ctx_clear(&ctx);
+}
+
+// computes a raised to d modulo n, stored in o, using the temporaries of ctx
+void pow_mod_ctx(mpz_t o, mpz_t a, mpz_t d, mpz_t n, nt_ctx_t *ctx) {
+  nt_exp_set(&ctx->exp, d);
+  pow_mod_exp_ctx(o, a, &ctx->exp, n, ctx);
+}
+
+// computes a raised to the exponent planned in x modulo n, stored in o,
+// using the temporaries of ctx
+void pow_mod_exp_ctx(mpz_t o, mpz_t a, const nt_exp_t *x, mpz_t n,
+                     nt_ctx_t *ctx) {
+  stats_add(STAT_POW_MOD, 1);
+  if (mpz_cmp_ui(n, 1) <= 0) { // everything is 0 mod 1
+    mpz_set_ui(o, 0);
+  } else if (x->nsteps == 0) { // a^0 = 1
+    mpz_set_ui(o, 1);
+  } else if (mpz_odd_p(n)) {
+    pow_mod_mont(o, a, x, n, ctx);
+  } else {
+    pow_mod_div(o, a, x, n, ctx);
   }
-  mpz_set(o, v);                 // o = v
-  mpz_clears(v, p, dcopy, NULL); // clear used mpzs
 }
 
 // conducts miller-rabin primality test to indicate if n is prime using iters
-// number of iterations
-bool is_prime(mpz_t n, uint64_t iters) {
-  mpz_t r, s, i, k;
-  mpz_inits(r, s, NULL);
-  mpz_sub_ui(r, n, 1);         // init r as n - 1
-  while (mpz_even_p(r) == 0) { // if r is odd
-    mpz_add_ui(s, s, 1);       // inc s by 1
-    mpz_fdiv_q_ui(r, r, 2);    // div r by 2
-  }
-  mpz_init_set_ui(i, 1);
-  mpz_init_set_ui(k, iters);
-  while (mpz_cmp(i, k) <= 0) {
-    mpz_t a, nsub3, y, nsub1;
-    mpz_inits(a, nsub3, y, nsub1, NULL);
-    mpz_sub_ui(nsub3, n, 3); // n - 3
-    mpz_init_set_ui(
-        a, gmp_urandomm_ui(state,
-                           mpz_get_ui(nsub3))); // set a = ran # from 0 to n - 4
-    mpz_add_ui(a, a, 2);     // add 2 to a so range is from 2 to n - 2
-    pow_mod(y, a, r, n);     // set y = pow_mod(a, r, n)
-    mpz_sub_ui(nsub1, n, 1); // n - 1 for checking conditions in while loop
-    if (mpz_cmp_ui(y, 1) != 0 && mpz_cmp(y, nsub1) != 0) {
-      mpz_t j;
-      mpz_init_set_ui(j, 1);
-      mpz_t ssub1;
-      mpz_init(ssub1);
-      mpz_sub_ui(ssub1, s, 1); // s - 1 for checking conditions in while loop
-      mpz_t d;
-      mpz_init_set_ui(d, 2); // mpz_t d = 2 for pass into pow_mod
-      while (mpz_cmp(j, ssub1) <= 0 && mpz_cmp(y, nsub1) != 0) {
-        pow_mod(y, y, d, n); // y = pow_mod(y, 2, n)
-        if (mpz_cmp_ui(y, 1) == 0) {
-          mpz_clears(r, s, i, k, a, nsub3, y, nsub1, ssub1, j, d,
-                     NULL); // clear used mpzs
-          return false;
-        }
-        mpz_add_ui(j, j, 1);
-      }
-      if (mpz_cmp(y, nsub1) != 0) {
-        mpz_clears(r, s, i, k, a, nsub3, y, nsub1, ssub1, j,
-                   NULL); // clear used mpzs
+// number of iterations, drawing witnesses from rs
+bool is_prime(mpz_t n, uint64_t iters, randstate_t *rs) {
+  nt_ctx_t ctx;
+  nt_ctx_init(&ctx, 0);
+  bool prime = is_prime_ctx(n, iters, rs, &ctx);
+  nt_ctx_clear(&ctx);
+  return prime;
+}
+
+// conducts miller-rabin primality test to indicate if n is prime using iters
+// number of iterations, drawing witnesses from rs and using the temporaries
+// of ctx
+bool is_prime_ctx(mpz_t n, uint64_t iters, randstate_t *rs, nt_ctx_t *ctx) {
+  if (mpz_cmp_ui(n, 4) < 0) { // 2 and 3 are the only primes below 4
+    return mpz_cmp_ui(n, 2) >= 0;
+  }
+  if (mpz_even_p(n)) {
+    return false;
+  }
+  mpz_ptr r = ctx->r, a = ctx->a, y = ctx->y, nsub1 = ctx->nsub1;
+  mpz_sub_ui(nsub1, n, 1);
+  mp_bitcnt_t s = mpz_scan1(nsub1, 0); // n - 1 = 2^s r with r odd
+  mpz_fdiv_q_2exp(r, nsub1, s);
+  for (uint64_t i = 0; i < iters; i++) {
+    stats_add(STAT_MR_ROUNDS, 1);
+    mpz_sub_ui(y, n, 3);
+    mpz_urandomm(a, rs->mt, y); // a = random number from 0 to n - 4
+    mpz_add_ui(a, a, 2);        // add 2 to a so range is from 2 to n - 2
+    pow_mod_ctx(y, a, r, n, ctx); // y = a^r mod n
+    if (mpz_cmp_ui(y, 1) == 0 || mpz_cmp(y, nsub1) == 0) {
+      continue;
+    }
+    for (mp_bitcnt_t j = 1; j < s && mpz_cmp(y, nsub1) != 0; j++) {
+      mpz_mul(a, y, y);
+      mpz_mod(y, a, n); // y = y^2 mod n
+      if (mpz_cmp_ui(y, 1) == 0) {
         return false;
       }
     }
-    mpz_add_ui(i, i, 1);
+    if (mpz_cmp(y, nsub1) != 0) {
+      return false;
+    }
   }
-  mpz_clears(r, s, i, k, NULL); // clear used mpzs
   return true;
 }
 
-// use urandomb for makeprime
-void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
-  while (true) {                  // looping until prime is made
-    mpz_urandomb(p, state, bits); // generate random num
-    if (is_prime(p, iters) && mpz_sizeinbase(p, 2) >= bits - 1) {     // check if random num is prime
-      return;
+#define SIEVE_LIMIT 32768 // odd primes below this are sieved out
+#define SIEVE_PRIMES 3511 // number of odd primes below SIEVE_LIMIT
+#define SIEVE_SPAN 2048   // odd candidates per sieve window
+#define SIEVE_MIN_BITS 17 // smaller candidates could be sieve primes
+
+static uint32_t small_primes[SIEVE_PRIMES];
+static pthread_once_t small_primes_once = PTHREAD_ONCE_INIT;
+
+// fills small_primes with the odd primes below SIEVE_LIMIT
+static void small_primes_init(void) {
+  static bool comp[SIEVE_LIMIT];
+  size_t count = 0;
+  for (uint32_t i = 3; i < SIEVE_LIMIT; i += 2) {
+    if (comp[i]) {
+      continue;
+    }
+    small_primes[count++] = i;
+    for (uint32_t j = i * i; j < SIEVE_LIMIT; j += 2 * i) {
+      comp[j] = true;
+    }
+  }
+}
+
+// a window of SIEVE_SPAN odd candidates base, base + 2, base + 4, ... along
+// with the residues of base modulo every sieve prime
+typedef struct {
+  mpz_t base;
+  uint32_t res[SIEVE_PRIMES];
+  bool comp[SIEVE_SPAN]; // set for candidates with a small factor
+} sieve_t;
+
+// starts a sieve at a random odd bits wide number with its top bit set
+static void sieve_seed(sieve_t *s, uint64_t bits, randstate_t *rs) {
+  mpz_urandomb(s->base, rs->mt, bits);
+  mpz_setbit(s->base, bits - 1);
+  mpz_setbit(s->base, 0);
+  for (size_t i = 0; i < SIEVE_PRIMES; i++) {
+    s->res[i] = mpz_fdiv_ui(s->base, small_primes[i]);
+  }
+}
+
+// moves the sieve to the next window, updating the residues incrementally,
+// or reseeds it if the next window would run past bits
+static void sieve_next(sieve_t *s, uint64_t bits, randstate_t *rs) {
+  mpz_add_ui(s->base, s->base, 4 * SIEVE_SPAN);
+  if (mpz_sizeinbase(s->base, 2) > bits) {
+    sieve_seed(s, bits, rs);
+    return;
+  }
+  mpz_sub_ui(s->base, s->base, 2 * SIEVE_SPAN);
+  for (size_t i = 0; i < SIEVE_PRIMES; i++) {
+    s->res[i] = (s->res[i] + 2 * SIEVE_SPAN) % small_primes[i];
+  }
+}
+
+// sieves the current window and runs miller-rabin on the survivors in order,
+// storing the first prime in p; returns false if the window has no prime
+static bool sieve_window(sieve_t *s, mpz_t p, uint64_t iters,
+                         randstate_t *rs, nt_ctx_t *ctx) {
+  memset(s->comp, 0, sizeof(s->comp));
+  for (size_t i = 0; i < SIEVE_PRIMES; i++) {
+    uint32_t q = small_primes[i];
+    // base + 2j = 0 mod q for j = -res / 2 mod q, and 1/2 = (q + 1) / 2
+    uint64_t j = (uint64_t)((q - s->res[i]) % q) * ((q + 1) / 2) % q;
+    for (; j < SIEVE_SPAN; j += q) {
+      s->comp[j] = true;
+    }
+  }
+  uint64_t sieved = 0;
+  for (size_t j = 0; j < SIEVE_SPAN; j++) {
+    if (s->comp[j]) {
+      sieved++;
+      continue;
+    }
+    mpz_add_ui(p, s->base, 2 * j);
+    if (is_prime_ctx(p, iters, rs, ctx)) {
+      stats_add(STAT_CANDIDATES, j + 1);
+      stats_add(STAT_SIEVED, sieved);
+      return true;
+    }
+  }
+  stats_add(STAT_CANDIDATES, SIEVE_SPAN);
+  stats_add(STAT_SIEVED, sieved);
+  return false;
+}
+
+// makes a prime drawing candidates and witnesses from rs. candidates are
+// walked up from a random odd start, and only those without a factor below
+// SIEVE_LIMIT get a miller-rabin test
+void make_prime(mpz_t p, uint64_t bits, uint64_t iters, randstate_t *rs) {
+  if (bits < SIEVE_MIN_BITS) {
+    while (true) {                   // looping until prime is made
+      mpz_urandomb(p, rs->mt, bits); // generate random num
+      stats_add(STAT_CANDIDATES, 1);
+      if (is_prime(p, iters, rs) &&
+          mpz_sizeinbase(p, 2) >= bits - 1) { // check if random num is prime
+        return;
+      }
+    }
+  }
+  pthread_once(&small_primes_once, small_primes_init);
+  nt_ctx_t ctx;
+  nt_ctx_init(&ctx, bits);
+  sieve_t *s = malloc(sizeof(sieve_t));
+  mpz_init(s->base);
+  sieve_seed(s, bits, rs);
+  while (!sieve_window(s, p, iters, rs, &ctx)) {
+    sieve_next(s, bits, rs);
+  }
+  mpz_clear(s->base);
+  free(s);
+  nt_ctx_clear(&ctx);
+}
+
+// shared state of a parallel prime search
+typedef struct {
+  uint64_t bits, iters;
+  const randstate_t *rs;     // random state the search streams split from
+  uint64_t stream;           // first random stream of this search
+  uint32_t workers;          // number of search streams
+  atomic_uint_fast64_t best; // lowest window index holding a prime so far
+  pthread_mutex_t lock;      // guards prime
+  mpz_t prime;
+} prime_search_t;
+
+// searches one random stream: worker w sieves windows w, w + workers,
+// w + 2 workers, ... of its own stream and stops once a lower window has
+// been found to hold a prime
+static void prime_search_job(void *arg, uint64_t w, uint32_t worker) {
+  (void)worker;
+  prime_search_t *s = (prime_search_t *)arg;
+  randstate_t rs;
+  randstate_split(&rs, s->rs, s->stream + w);
+  mpz_t c;
+  mpz_init(c);
+  nt_ctx_t ctx;
+  nt_ctx_init(&ctx, s->bits);
+  sieve_t *sv = malloc(sizeof(sieve_t));
+  mpz_init(sv->base);
+  sieve_seed(sv, s->bits, &rs);
+  for (uint64_t idx = w; idx < atomic_load(&s->best); idx += s->workers) {
+    if (sieve_window(sv, c, s->iters, &rs, &ctx)) {
+      pthread_mutex_lock(&s->lock);
+      if (idx < atomic_load(&s->best)) {
+        atomic_store(&s->best, idx);
+        mpz_set(s->prime, c);
+      }
+      pthread_mutex_unlock(&s->lock);
+      break;
+    }
+    sieve_next(sv, s->bits, &rs);
+  }
+  mpz_clear(sv->base);
+  free(sv);
+  nt_ctx_clear(&ctx);
+  mpz_clear(c);
+  randstate_clear(&rs);
+}
+
+// makes a prime by searching pool_threads(pool) streams split from rs in
+// parallel, starting at the given stream number. sieve windows are numbered
+// across the streams and the prime in the lowest window wins, so the result
+// depends only on the seed, the stream and the thread count, never on timing
+void make_prime_mt(mpz_t p, uint64_t bits, uint64_t iters, pool_t *pool,
+                   const randstate_t *rs, uint64_t stream) {
+  if (bits < SIEVE_MIN_BITS) {
+    randstate_t sub;
+    randstate_split(&sub, rs, stream);
+    make_prime(p, bits, iters, &sub);
+    randstate_clear(&sub);
+    return;
+  }
+  pthread_once(&small_primes_once, small_primes_init);
+  prime_search_t s;
+  s.bits = bits;
+  s.iters = iters;
+  s.rs = rs;
+  s.stream = stream;
+  s.workers = pool_threads(pool);
+  atomic_init(&s.best, UINT64_MAX);
+  pthread_mutex_init(&s.lock, NULL);
+  mpz_init(s.prime);
+  pool_run(pool, prime_search_job, &s, s.workers);
+  mpz_set(p, s.prime);
+  mpz_clear(s.prime);
+  pthread_mutex_destroy(&s.lock);
+}
+
+#if LONG_MAX >> 62 > 0 && GMP_NUMB_BITS >= 64
+#define LEHMER_BITS 62 // bits of the leading words lehmer steps work on
+#else
+#define LEHMER_BITS 30
+#endif
+
+// returns the LEHMER_BITS bits of x starting at bit s, for x below
+// 2^(s + LEHMER_BITS)
+static long bits_from(mpz_t x, mp_bitcnt_t s) {
+  size_t n = mpz_size(x);
+  const mp_limb_t *xp = mpz_limbs_read(x);
+  size_t i = s / GMP_NUMB_BITS;
+  unsigned sh = s % GMP_NUMB_BITS;
+  if (i >= n) {
+    return 0;
+  }
+  mp_limb_t v = xp[i] >> sh;
+  if (sh > 0 && i + 1 < n) {
+    v |= xp[i + 1] << (GMP_NUMB_BITS - sh);
+  }
+  return (long)(v & (((mp_limb_t)1 << LEHMER_BITS) - 1));
+}
+
+// runs euclid on the leading words of a > b > 0 for as long as the
+// quotients provably match those of a and b (knuth's algorithm L), storing
+// the cofactors of the steps in m; returns false if no step was certain
+static bool lehmer_step(mpz_t a, mpz_t b, long m[4]) {
+  mp_bitcnt_t s = mpz_sizeinbase(a, 2) - LEHMER_BITS;
+  long ah = bits_from(a, s), bh = bits_from(b, s);
+  long x0 = 1, x1 = 0, y0 = 0, y1 = 1;
+  while (bh + y0 > 0 && bh + y1 > 0) {
+    long q = (ah + x0) / (bh + y0);
+    if (q != (ah + x1) / (bh + y1)) { // the word no longer decides q
+      break;
+    }
+    long t = x0 - q * y0;
+    x0 = y0;
+    y0 = t;
+    t = x1 - q * y1;
+    x1 = y1;
+    y1 = t;
+    t = ah - q * bh;
+    ah = bh;
+    bh = t;
+  }
+  m[0] = x0;
+  m[1] = x1;
+  m[2] = y0;
+  m[3] = y1;
+  return x1 != 0;
+}
+
+// replaces (x, y) by (m0 x + m1 y, m2 x + m3 y) using p and t as scratch
+static void lehmer_apply(mpz_t x, mpz_t y, long m[4], mpz_t p, mpz_t t) {
+  mpz_mul_si(t, x, m[0]);
+  mpz_mul_si(p, y, m[1]);
+  mpz_add(t, t, p);
+  mpz_mul_si(p, x, m[2]);
+  mpz_mul_si(y, y, m[3]);
+  mpz_add(y, y, p);
+  mpz_swap(x, t);
+}
+
+// runs euclid's algorithm on r1 and r2 until r2 is zero, leaving the last
+// nonzero remainder in r1. if t1 and t2 are not NULL they are updated to
+// t2, t1 - q t2 with every quotient q, as extended euclid does. while
+// r1 > r2 > 0 and r1 is wider than a word, lehmer steps take many quotients
+// at once; they are only taken when exact, so every remainder and cofactor
+// is the one the step by step loop would reach
+static void euclid(mpz_t r1, mpz_t r2, mpz_t t1, mpz_t t2, nt_ctx_t *ctx) {
+  mpz_ptr q = ctx->q, tmp = ctx->tmp;
+  long m[4];
+  while (mpz_sgn(r2) != 0) {
+    if (mpz_sgn(r2) > 0 && mpz_sizeinbase(r1, 2) > LEHMER_BITS &&
+        mpz_cmp(r1, r2) > 0 && lehmer_step(r1, r2, m)) {
+      lehmer_apply(r1, r2, m, q, tmp);
+      if (t1 != NULL) {
+        lehmer_apply(t1, t2, m, q, tmp);
+      }
+      continue;
+    }
+    if (t1 == NULL) {
+      mpz_mod(tmp, r1, r2); // tmp = r1 mod r2
+    } else {
+      mpz_fdiv_qr(q, tmp, r1, r2); // q = r1/r2 (fdiv), tmp = r1 - q x r2
+    }
+    mpz_swap(r1, r2);  // r1 = r2
+    mpz_swap(r2, tmp); // r2 = r1 - q x r2
+    if (t1 != NULL) {
+      mpz_mul(tmp, q, t2);
+      mpz_sub(tmp, t1, tmp); // tmp = t1 - q x t2
+      mpz_swap(t1, t2);      // t1 = t2
+      mpz_swap(t2, tmp);     // t2 = t1 - q x t2
     }
   }
 }
@@ -90,54 +722,45 @@ void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
 // computes greatest common divisor of a and b, storing value of computed
 // divisor in d
 void gcd(mpz_t d, mpz_t a, mpz_t b) {
-  mpz_t t, acopy, bcopy;
-  mpz_inits(t, acopy, bcopy, NULL);
-  mpz_set(acopy, a);
-  mpz_set(bcopy, b);
-  while (mpz_cmp_ui(bcopy, 0) != 0) {
-    mpz_set(t, bcopy);            // t = b
-    mpz_mod(bcopy, acopy, bcopy); // b = a mod b
-    mpz_set(acopy, t);            // a = t
-  }
-  mpz_set(d, acopy); // store gcd in d
-  mpz_clears(t, acopy, bcopy, NULL);
+  nt_ctx_t ctx;
+  nt_ctx_init(&ctx, 0);
+  gcd_ctx(d, a, b, &ctx);
+  nt_ctx_clear(&ctx);
+}
+
+// computes greatest common divisor of a and b into d using the temporaries
+// of ctx
+void gcd_ctx(mpz_t d, mpz_t a, mpz_t b, nt_ctx_t *ctx) {
+  mpz_ptr r1 = ctx->r1, r2 = ctx->r2;
+  mpz_set(r1, a);
+  mpz_set(r2, b);
+  euclid(r1, r2, NULL, NULL, ctx);
+  mpz_set(d, r1); // store gcd in d
 }
 
 // computes inverse o of a modulo n (if modular inverse cannot be found o = 0)
 void mod_inverse(mpz_t o, mpz_t a, mpz_t n) {
-  mpz_t r1, r2, t1, t2;
-  mpz_init_set(r1, n);    // r1 = n
-  mpz_init_set(r2, a);    // r2 = a
-  mpz_init_set_si(t1, 0); // t1 = 0
-  mpz_init_set_si(t2, 1); // t2 = 1
-  while (mpz_cmp_ui(r2, 0) != 0) {
-    mpz_t q;
-    mpz_init(q);
-    mpz_fdiv_q(q, r1, r2); // q = r1/r2 (fdiv)
-    mpz_t rtmp, rtmp2;
-    mpz_init_set(rtmp, r1); // rtmp = r1
-    mpz_set(r1, r2);        // r1 = r2
-    mpz_init(rtmp2);
-    mpz_mul(rtmp2, q, r2);       // rtmp2 = q x r2
-    mpz_sub(rtmp2, rtmp, rtmp2); // rtmp2 = r1 - (q x r2)
-    mpz_set(r2, rtmp2);          // r2 = r1 - q x r2
-    mpz_t ttmp, ttmp2;
-    mpz_init_set(ttmp, t1); // ttmp = t1
-    mpz_set(t1, t2);        // t1 = t2
-    mpz_init(ttmp2);
-    mpz_mul(ttmp2, q, t2);       // ttmp2 = q x t2
-    mpz_sub(ttmp2, ttmp, ttmp2); // ttmp2 = t1 - (q x t2)
-    mpz_set(t2, ttmp2);          // t2 = t1 - q x t2
-    mpz_clears(q, rtmp, rtmp2, ttmp, ttmp2, NULL);
-  }
+  nt_ctx_t ctx;
+  nt_ctx_init(&ctx, 0);
+  mod_inverse_ctx(o, a, n, &ctx);
+  nt_ctx_clear(&ctx);
+}
+
+// computes inverse o of a modulo n using the temporaries of ctx (if modular
+// inverse cannot be found o = 0)
+void mod_inverse_ctx(mpz_t o, mpz_t a, mpz_t n, nt_ctx_t *ctx) {
+  mpz_ptr r1 = ctx->r1, r2 = ctx->r2, t1 = ctx->t1, t2 = ctx->t2;
+  mpz_set(r1, n);    // r1 = n
+  mpz_set(r2, a);    // r2 = a
+  mpz_set_ui(t1, 0); // t1 = 0
+  mpz_set_ui(t2, 1); // t2 = 1
+  euclid(r1, r2, t1, t2, ctx);
   if (mpz_cmp_si(r1, 1) > 0) {
-    mpz_set_ui(o, 0);                 // o = 0
-    mpz_clears(r1, r2, t1, t2, NULL); // clear used mpzs before return
+    mpz_set_ui(o, 0); // o = 0
     return;
   }
   if (mpz_cmp_si(t1, 0) < 0) {
     mpz_add(t1, t1, n); // t1 = t1 + n
   }
-  mpz_set(o, t1);                   // o = t1
-  mpz_clears(r1, r2, t1, t2, NULL); // clear used mpzs at end of fxn
+  mpz_set(o, t1); // o = t1
 }
@@ -4,15 +4,187 @@
 #include <stdio.h>
 #include <gmp.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include "pool.h"
+#include "randstate.h"
 // clang-format on
 
+#define NT_TABLE 32 // odd powers kept by the widest pow_mod window
+#define NT_MONTS 4  // moduli a context can hold montgomery constants for
+
+//
+// Montgomery constants of an odd modulus n, letting pow_mod skip the
+// division that converts its base into montgomery form.
+//
+typedef struct {
+  const mp_limb_t *np; // the limbs of n, which must stay in place
+  const mp_limb_t *r2; // R^2 mod n in nn limbs, with R = 2^(nn GMP_NUMB_BITS)
+  mp_size_t nn;        // limbs in n
+  mp_limb_t ninv;      // -n^-1 mod 2^GMP_NUMB_BITS
+} nt_mont_t;
+
+//
+// One window of a recoded exponent: square the running power squarings
+// times, then multiply in the odd power a^(2 power + 1).
+//
+typedef struct {
+  uint32_t squarings;
+  uint32_t power;
+} nt_step_t;
+
+//
+// An exponent recoded once into the sliding windows pow_mod works through,
+// so that raising many bases to the same exponent does not rescan its bits.
+// Only the odd powers the windows use are computed, which turns the plan
+// for a small exponent such as 65537 into a plain addition chain.
+//
+typedef struct {
+  nt_step_t *steps;   // windows from the most significant down
+  size_t nsteps;      // windows in steps
+  size_t cap;         // windows allocated in steps
+  size_t tsize;       // odd powers a^1, a^3, ... the windows multiply in
+  uint64_t tail;      // squarings after the last window
+  uint64_t squarings; // squarings in total
+} nt_exp_t;
+
+//
+// Scratch space reused across numtheory calls, so that a loop calling the
+// _ctx functions stops allocating once the temporaries have grown to the
+// size of its operands. A context must only be used by one thread at a time.
+//
+typedef struct {
+  mp_limb_t *limbs;      // montgomery table and products for pow_mod
+  size_t nlimbs;         // limbs allocated in limbs
+  mpz_t t, acc, sq;      // pow_mod residues
+  mpz_t table[NT_TABLE]; // pow_mod odd powers for even moduli
+  mpz_t r, a, y, nsub1;  // miller-rabin
+  mpz_t r1, r2, t1, t2, q, tmp; // gcd and mod_inverse
+  nt_mont_t mont[NT_MONTS];     // constants of the prepared moduli
+  mp_limb_t *owned[NT_MONTS];   // r2 of each entry if computed here
+  int nmont;
+  nt_exp_t exp; // plan of the exponent passed to pow_mod_ctx
+} nt_ctx_t;
+
+//
+// Initializes a context with temporaries preallocated for operands of up to
+// bits bits. Larger operands still work; the temporaries grow on first use.
+//
+// ctx: the context to initialize.
+// bits: the expected size of the modulus in bits, or 0 to allocate lazily.
+//
+void nt_ctx_init(nt_ctx_t *ctx, uint64_t bits);
+
+//
+// Frees the memory used by a context.
+//
+// ctx: the context to clear.
+//
+void nt_ctx_clear(nt_ctx_t *ctx);
+
+//
+// Makes pow_mod_ctx calls with modulus n use precomputed montgomery
+// constants: the ones shared with nt_mont_share() for the same limbs of n,
+// or else ones computed now. n must not be modified while ctx is in use.
+// Even moduli and moduli beyond NT_MONTS are left unprepared.
+//
+// ctx: the context to prepare.
+// n: the modulus.
+//
+void nt_ctx_prepare(nt_ctx_t *ctx, mpz_t n);
+
+//
+// Fills in the montgomery constants of an odd modulus n > 1.
+//
+// m: the constants to fill in.
+// r2: will store R^2 mod n; must hold mpz_size(n) limbs.
+// n: the modulus, whose limbs m refers to.
+//
+void nt_mont_set(nt_mont_t *m, mp_limb_t *r2, mpz_t n);
+
+//
+// Shares precomputed montgomery constants, such as ones read from a key
+// file, with every later nt_ctx_prepare() for the same limbs. Must be
+// called before any thread uses them; m must stay shared while they do.
+//
+// m: the constants to share.
+// returns: true if m is shared, false if there was no memory to record it.
+//
+bool nt_mont_share(const nt_mont_t *m);
+
+//
+// Stops sharing constants given to nt_mont_share(), before the limbs they
+// refer to go away. Contexts prepared earlier keep their copy, so no thread
+// may still use them.
+//
+// m: the constants to stop sharing.
+//
+void nt_mont_unshare(const nt_mont_t *m);
+
+//
+// Initializes an empty exponent plan.
+//
+// x: the plan to initialize.
+//
+void nt_exp_init(nt_exp_t *x);
+
+//
+// Frees the memory used by an exponent plan.
+//
+// x: the plan to clear.
+//
+void nt_exp_clear(nt_exp_t *x);
+
+//
+// Recodes a non-negative exponent into a plan, reusing its memory.
+//
+// x: the plan to fill in.
+// d: the exponent.
+//
+void nt_exp_set(nt_exp_t *x, mpz_t d);
+
 void gcd(mpz_t d, mpz_t a, mpz_t b);
 
+void gcd_ctx(mpz_t d, mpz_t a, mpz_t b, nt_ctx_t *ctx);
+
 void mod_inverse(mpz_t o, mpz_t a, mpz_t n);
 
+void mod_inverse_ctx(mpz_t o, mpz_t a, mpz_t n, nt_ctx_t *ctx);
+
 void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n);
 
-bool is_prime(mpz_t n, uint64_t iters);
+void pow_mod_ctx(mpz_t o, mpz_t a, mpz_t d, mpz_t n, nt_ctx_t *ctx);
+
+//
+// Computes a raised to the exponent recoded in x modulo n, stored in o.
+// The plan is only read, so threads may share it.
+//
+// o: will store the result.
+// a: the base.
+// x: the plan of the exponent.
+// n: the modulus.
+// ctx: the scratch of the calling thread.
+//
+void pow_mod_exp_ctx(mpz_t o, mpz_t a, const nt_exp_t *x, mpz_t n,
+                     nt_ctx_t *ctx);
+
+bool is_prime(mpz_t n, uint64_t iters, randstate_t *rs);
+
+bool is_prime_ctx(mpz_t n, uint64_t iters, randstate_t *rs, nt_ctx_t *ctx);
+
+void make_prime(mpz_t p, uint64_t bits, uint64_t iters, randstate_t *rs);
 
-void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
+//
+// Makes a prime by searching pool_threads(pool) streams split from rs in
+// parallel. The result depends only on the seed of rs, the stream and the
+// thread count, and rs itself is only read.
+//
+// p: will store the prime.
+// bits: the size in bits of the prime.
+// iters: the number of Miller-Rabin iterations.
+// pool: the workers to search on.
+// rs: the random state to split the search streams from.
+// stream: the number of the first stream, followed by one per worker.
+//
+void make_prime_mt(mpz_t p, uint64_t bits, uint64_t iters, pool_t *pool,
+                   const randstate_t *rs, uint64_t stream);
@@ -0,0 +1,146 @@
+#include "pool.h"
+// clang-format off
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+// clang-format on
+
+struct pool {
+  uint32_t threads;
+  pthread_t *tids;
+  pthread_mutex_t lock;
+  pthread_cond_t work; // signalled when a batch starts or the pool stops
+  pthread_cond_t done; // signalled when the last worker finishes a batch
+  uint64_t batch;      // generation counter of started batches
+  uint32_t active;     // workers still running the current batch
+  bool stop;
+  pool_job_t job;
+  void *arg;
+  uint64_t count;
+  atomic_uint_fast64_t next; // next index to hand out
+};
+
+typedef struct {
+  pool_t *pool;
+  uint32_t id;
+} worker_t;
+
+// worker thread loop: wait for a batch, drain its indices, report completion
+static void *pool_worker(void *arg) {
+  worker_t *w = (worker_t *)arg;
+  pool_t *p = w->pool;
+  uint64_t seen = 0; // last batch this worker took part in
+  pthread_mutex_lock(&p->lock);
+  while (true) {
+    while (!p->stop && p->batch == seen) {
+      pthread_cond_wait(&p->work, &p->lock);
+    }
+    if (p->stop) {
+      break;
+    }
+    seen = p->batch;
+    pool_job_t job = p->job;
+    void *jarg = p->arg;
+    uint64_t count = p->count;
+    pthread_mutex_unlock(&p->lock);
+
+    uint64_t i;
+    while ((i = atomic_fetch_add(&p->next, 1)) < count) {
+      job(jarg, i, w->id);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (--p->active == 0) {
+      pthread_cond_broadcast(&p->done);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  free(w);
+  return NULL;
+}
+
+// creates a pool with the given number of worker threads
+pool_t *pool_create(uint32_t threads) {
+  pool_t *p = (pool_t *)calloc(1, sizeof(pool_t));
+  if (p == NULL) {
+    return NULL;
+  }
+  p->threads = threads > 0 ? threads : 1;
+  p->tids = (pthread_t *)calloc(p->threads, sizeof(pthread_t));
+  if (p->tids == NULL) {
+    free(p);
+    return NULL;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work, NULL);
+  pthread_cond_init(&p->done, NULL);
+  atomic_init(&p->next, 0);
+  for (uint32_t i = 0; i < p->threads; i++) {
+    worker_t *w = (worker_t *)malloc(sizeof(worker_t));
+    if (w == NULL) {
+      p->threads = i; // only join the threads that were started
+      pool_delete(&p);
+      return NULL;
+    }
+    w->pool = p;
+    w->id = i;
+    if (pthread_create(&p->tids[i], NULL, pool_worker, w) != 0) {
+      free(w);
+      p->threads = i;
+      pool_delete(&p);
+      return NULL;
+    }
+  }
+  return p;
+}
+
+// stops and joins every worker, then frees the pool
+void pool_delete(pool_t **p) {
+  if (*p == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&(*p)->lock);
+  (*p)->stop = true;
+  pthread_cond_broadcast(&(*p)->work);
+  pthread_mutex_unlock(&(*p)->lock);
+  for (uint32_t i = 0; i < (*p)->threads; i++) {
+    pthread_join((*p)->tids[i], NULL);
+  }
+  pthread_mutex_destroy(&(*p)->lock);
+  pthread_cond_destroy(&(*p)->work);
+  pthread_cond_destroy(&(*p)->done);
+  free((*p)->tids);
+  free(*p);
+  *p = NULL;
+}
+
+// returns the number of worker threads
+uint32_t pool_threads(pool_t *p) { return p->threads; }
+
+// hands a new batch of count indices to the workers
+void pool_start(pool_t *p, pool_job_t job, void *arg, uint64_t count) {
+  pthread_mutex_lock(&p->lock);
+  p->job = job;
+  p->arg = arg;
+  p->count = count;
+  atomic_store(&p->next, 0);
+  p->active = p->threads;
+  p->batch++;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+}
+
+// blocks until every worker has finished the current batch
+void pool_wait(pool_t *p) {
+  pthread_mutex_lock(&p->lock);
+  while (p->active > 0) {
+    pthread_cond_wait(&p->done, &p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+// runs a batch to completion
+void pool_run(pool_t *p, pool_job_t job, void *arg, uint64_t count) {
+  pool_start(p, job, arg, count);
+  pool_wait(p);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+// clang-format off
+#include <stdbool.h>
+#include <stdint.h>
+// clang-format on
+
+typedef struct pool pool_t;
+
+//
+// A job run by the pool for every index of a batch.
+//
+// arg: the argument given to pool_start().
+// index: the index of the item to process.
+// worker: the id of the worker thread running the job, in [0, threads).
+//
+typedef void (*pool_job_t)(void *arg, uint64_t index, uint32_t worker);
+
+//
+// Creates a pool of worker threads.
+//
+// threads: the number of worker threads to start (at least 1).
+// returns: the new pool, or NULL if the threads could not be started.
+//
+pool_t *pool_create(uint32_t threads);
+
+//
+// Stops the worker threads and frees the pool, setting the pointer to NULL.
+// Any batch started with pool_start() must have been waited on.
+//
+// p: pointer to the pool to delete.
+//
+void pool_delete(pool_t **p);
+
+//
+// Returns the number of worker threads in the pool.
+//
+// p: the pool.
+//
+uint32_t pool_threads(pool_t *p);
+
+//
+// Starts running job(arg, i, worker) for every i in [0, count) on the
+// worker threads and returns immediately. Indices are handed out in order
+// to whichever worker is free next.
+//
+// p: the pool.
+// job: the job to run.
+// arg: the argument passed through to job.
+// count: the number of indices to process.
+//
+void pool_start(pool_t *p, pool_job_t job, void *arg, uint64_t count);
+
+//
+// Waits until every index of the batch started by pool_start() is done.
+//
+// p: the pool.
+//
+void pool_wait(pool_t *p);
+
+//
+// Runs a batch to completion: pool_start() followed by pool_wait().
+//
+// p: the pool.
+// job: the job to run.
+// arg: the argument passed through to job.
+// count: the number of indices to process.
+//
+void pool_run(pool_t *p, pool_job_t job, void *arg, uint64_t count);
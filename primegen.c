@@ -0,0 +1,198 @@
+// clang-format off
+#include <stdio.h>
+#include <gmp.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "numtheory.h"
+#include "pool.h"
+#include "primepool.h"
+#include "randstate.h"
+#include "rsa.h"
+// clang-format on
+
+#define OPTIONS "P:b:k:n:i:t:w:s:vh"
+#define PG_BATCH 64 // most primes made before adding them to the pool
+
+static volatile sig_atomic_t stopping = 0; // set by SIGINT and SIGTERM
+
+// prints the program synopsis and usage
+static void usage(void) {
+  fprintf(stderr, "Usage: ./primegen [options]\n");
+  fprintf(stderr, "  ./primegen fills a prime pool with verified primes of "
+                  "the sizes keygen needs,\n");
+  fprintf(stderr, "  so keygen -P can take them instead of searching. Run "
+                  "with -w it keeps the\n");
+  fprintf(stderr, "  pool topped up until it is interrupted.\n");
+  fprintf(stderr, "    -P <pool>   : The prime pool is <pool>. "
+                  "Default: primes.pool\n");
+  fprintf(stderr, "    -b <bits>   : Make primes for keys whose modulus has "
+                  "<bits> bits. Default: 1024\n");
+  fprintf(stderr, "    -k <primes> : Make primes for keys of <primes> "
+                  "primes, 2 to %d. Default: 2\n", RSA_MAX_PRIMES);
+  fprintf(stderr, "    -n <keys>   : Keep primes for <keys> keys in the "
+                  "pool. Default: 16\n");
+  fprintf(stderr, "    -i <iters>  : Run <iters> Miller-Rabin iterations "
+                  "for primality testing. Default: 50\n");
+  fprintf(stderr, "    -t <threads>: Search for primes with <threads> "
+                  "threads. Default: 1\n");
+  fprintf(stderr, "    -w <secs>   : Check the pool again every <secs> "
+                  "seconds instead of exiting.\n");
+  fprintf(stderr, "    -s <seed>   : Use <seed> as the random number seed. "
+                  "Default: /dev/urandom\n");
+  fprintf(stderr, "    -v          : Enable verbose output.\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
+
+// asks the main loop to stop
+static void on_signal(int sig) {
+  (void)sig;
+  stopping = 1;
+}
+
+// returns a seed read from /dev/urandom, falling back to the time, so two
+// generators filling one pool never repeat each other's primes
+static uint64_t urandom_seed(void) {
+  uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+  FILE *f = fopen("/dev/urandom", "rb");
+  if (f != NULL) {
+    if (fread(&seed, sizeof(seed), 1, f) != 1) {
+      seed ^= (uint64_t)clock();
+    }
+    fclose(f);
+  }
+  return seed;
+}
+
+int main(int argc, char **argv) {
+  const char *path = "primes.pool"; // default prime pool = primes.pool
+  uint64_t nbits = 1024; // default number of bits in the modulus = 1024
+  uint32_t nprimes = 2;  // default primes per key = 2
+  uint64_t keys = 16;    // default keys the pool holds primes for = 16
+  uint64_t iters = 50;   // default iters for testing primes = 50
+  uint32_t threads = 1;  // default prime search threads = 1
+  uint64_t wait = 0;     // default is to fill the pool once and exit
+  uint64_t seed = urandom_seed();
+  bool verbose = false;
+  int64_t opt = 0;
+  while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    switch (opt) {
+    case 'P':
+      path = optarg;
+      break;
+    case 'b':
+      nbits = strtoull(optarg, NULL, 10);
+      break;
+    case 'k':
+      nprimes = strtoul(optarg, NULL, 10);
+      if (nprimes < 2 || nprimes > RSA_MAX_PRIMES) {
+        fprintf(stderr, "primes must be between 2 and %d\n", RSA_MAX_PRIMES);
+        return 1;
+      }
+      break;
+    case 'n':
+      keys = strtoull(optarg, NULL, 10);
+      break;
+    case 'i':
+      iters = strtoull(optarg, NULL, 10);
+      break;
+    case 't':
+      threads = strtoul(optarg, NULL, 10);
+      if (threads == 0) {
+        fprintf(stderr, "threads must be at least 1\n");
+        return 1;
+      }
+      break;
+    case 'w':
+      wait = strtoull(optarg, NULL, 10);
+      if (wait == 0) {
+        fprintf(stderr, "seconds must be at least 1\n");
+        return 1;
+      }
+      break;
+    case 's':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'h':
+      usage();
+      return 0;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  uint64_t sizes[RSA_MAX_PRIMES];
+  rsa_prime_sizes(sizes, nbits, nprimes);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal; // no SA_RESTART, so sleep returns on a signal
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  randstate_t rs;
+  randstate_init(&rs, seed);
+  pool_t *pool = threads > 1 ? pool_create(threads) : NULL;
+  uint64_t stream = 0; // number of the next unused random stream
+  mpz_t batch[PG_BATCH];
+  for (uint32_t i = 0; i < PG_BATCH; i++) {
+    mpz_init(batch[i]);
+  }
+  int status = 0;
+  while (!stopping && status == 0) {
+    for (uint32_t i = 0; i < nprimes && !stopping && status == 0; i++) {
+      if (i > 0 && sizes[i] == sizes[i - 1]) {
+        continue; // sizes come in runs, each filled once
+      }
+      uint64_t want = 0; // primes of this size needed for keys keys
+      for (uint32_t j = 0; j < nprimes; j++) {
+        want += sizes[j] == sizes[i] ? keys : 0;
+      }
+      int64_t have = 0;
+      while (!stopping && (have = primepool_count(path, sizes[i])) >= 0 &&
+             (uint64_t)have < want) {
+        size_t made = 0; // primes made this round, added with one write
+        while (!stopping && made < PG_BATCH && have + made < want) {
+          if (pool != NULL) {
+            make_prime_mt(batch[made], sizes[i], iters, pool, &rs, stream);
+            stream += pool_threads(pool); // each search uses its own streams
+          } else {
+            make_prime(batch[made], sizes[i], iters, &rs);
+          }
+          made++;
+        }
+        if (!primepool_add(path, batch, made)) {
+          have = -1;
+          break;
+        }
+        if (verbose) {
+          printf("added %zu %" PRIu64 "-bit primes, %" PRIu64 " of %" PRIu64
+                 " in pool\n", made, sizes[i], have + made, want);
+        }
+      }
+      if (have < 0) {
+        fprintf(stderr, "%s: prime pool couldn't be updated\n", path);
+        status = 1;
+      }
+    }
+    if (wait == 0) {
+      break;
+    }
+    for (uint64_t s = 0; s < wait && !stopping; s++) {
+      sleep(1); // a signal ends the current second early
+    }
+  }
+  for (uint32_t i = 0; i < PG_BATCH; i++) {
+    mpz_clear(batch[i]);
+  }
+  pool_delete(&pool);
+  randstate_clear(&rs);
+  return status;
+}
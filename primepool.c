@@ -0,0 +1,289 @@
+#include "primepool.h"
+// clang-format off
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "numtheory.h"
+// clang-format on
+
+#define PP_MAGIC "#rsa-primes v2 " // start of the header line of a pool
+#define PP_HEADER (sizeof(PP_MAGIC) - 1 + 21) // header with offset and newline
+
+// a pool opened under its lock
+typedef struct {
+  int lock;      // descriptor holding the lock
+  FILE *f;       // the pool, or NULL if it does not exist
+  uint64_t live; // offset of the first record that may be unused
+  uint64_t end;  // offset after the last complete line read
+} pp_t;
+
+// a record of a pool, as read by pp_next
+typedef struct {
+  char *line;    // the line, without its newline
+  size_t cap;    // allocated size of line
+  uint64_t at;   // offset of the record
+  uint64_t next; // offset of the line after it
+  bool used;     // taken by keygen
+  uint64_t bits; // size of the prime in bits
+  char *hex;     // the hex digits of the prime, inside line
+} pp_rec_t;
+
+// a prime to be added, with its hex digits
+typedef struct {
+  char *hex;
+  size_t bits;
+  bool skip; // the pool or the batch already holds it
+} pp_new_t;
+
+// returns path with suffix appended, allocated with malloc
+static char *pp_path(const char *path, const char *suffix) {
+  char *p = (char *)malloc(strlen(path) + strlen(suffix) + 1);
+  sprintf(p, "%s%s", path, suffix);
+  return p;
+}
+
+// takes the exclusive lock of the pool at path; returns its descriptor, or
+// -1 if the lock file cannot be opened
+static int pp_lock(const char *path) {
+  char *lock = pp_path(path, ".lock");
+  int fd = open(lock, O_RDWR | O_CREAT, 0600);
+  free(lock);
+  if (fd < 0) {
+    return -1;
+  }
+  while (flock(fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+// writes the header of a pool whose unused records start at live
+static bool pp_set_live(FILE *f, uint64_t live) {
+  return fseeko(f, 0, SEEK_SET) == 0 &&
+         fprintf(f, "%s%020" PRIu64 "\n", PP_MAGIC, live) > 0 &&
+         fflush(f) == 0;
+}
+
+// locks the pool at path and opens it positioned at its first unused
+// record, creating it if create is set. returns false if it cannot be
+// opened or lacks the pool header; pp must be closed with pp_close either way
+static bool pp_open(const char *path, bool create, pp_t *pp) {
+  pp->f = NULL;
+  pp->live = pp->end = PP_HEADER;
+  pp->lock = pp_lock(path);
+  if (pp->lock < 0) {
+    return false;
+  }
+  int fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0600);
+  if (fd < 0) {
+    return errno == ENOENT; // no pool is an empty pool
+  }
+  pp->f = fdopen(fd, "r+");
+  if (pp->f == NULL) {
+    close(fd);
+    return false;
+  }
+  char head[PP_HEADER + 1];
+  size_t got = fread(head, 1, PP_HEADER, pp->f);
+  if (got == 0 && create) {
+    return pp_set_live(pp->f, PP_HEADER);
+  }
+  head[got] = '\0';
+  char *rest;
+  pp->live = pp->end = strtoull(head + strlen(PP_MAGIC), &rest, 10);
+  return got == PP_HEADER &&
+         strncmp(head, PP_MAGIC, strlen(PP_MAGIC)) == 0 && *rest == '\n' &&
+         pp->live >= PP_HEADER && fseeko(pp->f, pp->live, SEEK_SET) == 0;
+}
+
+// closes a pool opened by pp_open and releases its lock
+static void pp_close(pp_t *pp) {
+  if (pp->f != NULL) {
+    fclose(pp->f);
+  }
+  if (pp->lock >= 0) {
+    flock(pp->lock, LOCK_UN);
+    close(pp->lock);
+  }
+}
+
+// reads the record at the position of the pool into r, skipping lines that
+// are not records. returns false at the end of the pool, which may be a
+// line cut short by a crash
+static bool pp_next(pp_t *pp, pp_rec_t *r) {
+  while (pp->f != NULL) {
+    r->at = (uint64_t)ftello(pp->f);
+    ssize_t len = getline(&r->line, &r->cap, pp->f);
+    if (len <= 0 || r->line[len - 1] != '\n') {
+      return false;
+    }
+    r->next = pp->end = r->at + (uint64_t)len;
+    r->line[len - 1] = '\0';
+    char *rest = r->line;
+    if (len > 3 && (r->line[0] == '+' || r->line[0] == '-') &&
+        r->line[1] == ' ') {
+      r->bits = strtoull(r->line + 2, &rest, 10);
+    }
+    if (rest > r->line + 2 && *rest == ' ') {
+      r->used = r->line[0] == '-';
+      r->hex = rest + 1;
+      return true;
+    }
+  }
+  return false;
+}
+
+// orders primes to be added by size, then by their hex digits
+static int pp_cmp(const void *x, const void *y) {
+  const pp_new_t *a = (const pp_new_t *)x, *b = (const pp_new_t *)y;
+  return a->bits != b->bits ? (a->bits < b->bits ? -1 : 1)
+                            : strcmp(a->hex, b->hex);
+}
+
+// writes the unused records of pp, then the primes of add that are not
+// skipped, to a synced copy renamed over the pool at path
+static bool pp_compact(const char *path, pp_t *pp, pp_new_t *add,
+                       size_t count) {
+  char *tmp = pp_path(path, ".tmp");
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+  bool ok = f != NULL && pp_set_live(f, PP_HEADER) &&
+            fseeko(pp->f, pp->live, SEEK_SET) == 0;
+  pp_rec_t r = { .line = NULL, .cap = 0 };
+  while (ok && pp_next(pp, &r)) {
+    if (!r.used) {
+      ok = fprintf(f, "+ %" PRIu64 " %s\n", r.bits, r.hex) > 0;
+    }
+  }
+  for (size_t i = 0; ok && i < count; i++) {
+    if (!add[i].skip) {
+      ok = fprintf(f, "+ %zu %s\n", add[i].bits, add[i].hex) > 0;
+    }
+  }
+  free(r.line);
+  if (f != NULL) {
+    ok = fflush(f) == 0 && fsync(fd) == 0 && ok;
+    ok = fclose(f) == 0 && ok;
+  } else if (fd >= 0) {
+    close(fd);
+  }
+  ok = ok && rename(tmp, path) == 0;
+  if (!ok) {
+    unlink(tmp);
+  }
+  free(tmp);
+  return ok;
+}
+
+// adds the primes the pool at path does not hold with one write
+bool primepool_add(const char *path, mpz_t primes[], size_t count) {
+  pp_new_t *add = (pp_new_t *)malloc((count + 1) * sizeof(pp_new_t));
+  for (size_t i = 0; i < count; i++) {
+    add[i].hex = mpz_get_str(NULL, 16, primes[i]);
+    add[i].bits = mpz_sizeinbase(primes[i], 2);
+    add[i].skip = false;
+  }
+  qsort(add, count, sizeof(pp_new_t), pp_cmp);
+  for (size_t i = 1; i < count; i++) {
+    add[i].skip = add[i].skip || pp_cmp(&add[i - 1], &add[i]) == 0;
+  }
+  pp_t pp;
+  bool ok = pp_open(path, true, &pp);
+  uint64_t used = pp.live - PP_HEADER; // bytes of used records
+  uint64_t unused = 0;                 // bytes of unused records
+  pp_rec_t r = { .line = NULL, .cap = 0 };
+  while (ok && pp_next(&pp, &r)) {
+    if (r.used) {
+      used += r.next - r.at;
+      continue;
+    }
+    unused += r.next - r.at;
+    pp_new_t key = { .hex = r.hex, .bits = r.bits };
+    pp_new_t *dup = (pp_new_t *)bsearch(&key, add, count, sizeof(pp_new_t),
+                                        pp_cmp);
+    if (dup != NULL) {
+      dup->skip = true;
+    }
+  }
+  if (ok && used > unused) { // mostly used, so copy the rest to a new pool
+    ok = pp_compact(path, &pp, add, count);
+  } else if (ok) { // append after the last complete line and sync once
+    ok = ftruncate(fileno(pp.f), (off_t)pp.end) == 0 &&
+         fseeko(pp.f, (off_t)pp.end, SEEK_SET) == 0;
+    for (size_t i = 0; ok && i < count; i++) {
+      if (!add[i].skip) {
+        ok = fprintf(pp.f, "+ %zu %s\n", add[i].bits, add[i].hex) > 0;
+      }
+    }
+    ok = ok && fflush(pp.f) == 0 && fsync(fileno(pp.f)) == 0;
+  }
+  pp_close(&pp);
+  free(r.line);
+  for (size_t i = 0; i < count; i++) {
+    free(add[i].hex);
+  }
+  free(add);
+  return ok;
+}
+
+// counts the unused primes of the given size in the pool at path
+int64_t primepool_count(const char *path, uint64_t bits) {
+  pp_t pp;
+  int64_t count = pp_open(path, false, &pp) ? 0 : -1;
+  pp_rec_t r = { .line = NULL, .cap = 0 };
+  while (count >= 0 && pp_next(&pp, &r)) {
+    count += !r.used && r.bits == bits;
+  }
+  free(r.line);
+  pp_close(&pp);
+  return count;
+}
+
+// marks the first unused prime of the given size, with p - 1 coprime to e,
+// used in the pool at path and stores it in p
+bool primepool_take(const char *path, mpz_t p, uint64_t bits, mpz_t e) {
+  pp_t pp;
+  bool ok = pp_open(path, false, &pp);
+  bool found = false;
+  bool first = true; // no unused record comes before the one taken
+  mpz_t g;
+  mpz_init(g);
+  pp_rec_t r = { .line = NULL, .cap = 0 };
+  while (ok && !found && pp_next(&pp, &r)) {
+    if (!r.used && r.bits == bits) {
+      found = mpz_set_str(p, r.hex, 16) == 0 && mpz_sizeinbase(p, 2) == bits;
+      if (found && e != NULL) {
+        mpz_sub_ui(g, p, 1);
+        gcd(g, g, e);
+        found = mpz_cmp_ui(g, 1) == 0;
+      }
+    }
+    first = first && (found || r.used);
+  }
+  if (found) { // mark the record and commit before the prime is used
+    uint64_t live = r.next;
+    found = fseeko(pp.f, (off_t)r.at, SEEK_SET) == 0 &&
+            fputc('-', pp.f) != EOF && fflush(pp.f) == 0 &&
+            fsync(fileno(pp.f)) == 0;
+    if (found && first) { // skip the used records at the front from now on
+      fseeko(pp.f, (off_t)live, SEEK_SET);
+      while (pp_next(&pp, &r) && r.used) {
+        live = r.next;
+      }
+      pp_set_live(pp.f, live); // a stale offset only costs time
+    }
+  }
+  mpz_clear(g);
+  free(r.line);
+  pp_close(&pp);
+  return found;
+}
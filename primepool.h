@@ -0,0 +1,52 @@
+#pragma once
+
+// clang-format off
+#include <gmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+// clang-format on
+
+//
+// A prime pool is a text file of verified primes that primegen fills ahead
+// of time and keygen -P draws from. Every change happens under an exclusive
+// flock() on <pool>.lock. Primes are appended in batches and a taken prime
+// is marked used in place and synced before keygen gets it, so a crash can
+// lose primes but never hand one out twice. The header records where the
+// unused primes start, and an add that finds the pool mostly used renames a
+// compacted copy over it. The pool is created readable by its owner only.
+//
+
+//
+// Adds primes to a pool with one synced write, creating the pool if
+// needed. Primes the pool already holds unused are not added again.
+//
+// path: the path of the pool.
+// primes: the primes to add.
+// count: the number of primes.
+// returns: true if the primes are in the pool, false if the pool is
+//          malformed or cannot be written.
+//
+bool primepool_add(const char *path, mpz_t primes[], size_t count);
+
+//
+// Counts the unused primes of one size in a pool.
+//
+// path: the path of the pool.
+// bits: the size in bits of the primes to count.
+// returns: the number of primes of that size, 0 if the pool does not exist,
+//          or -1 if it is malformed or cannot be read.
+//
+int64_t primepool_count(const char *path, uint64_t bits);
+
+//
+// Takes the first unused prime of a size from a pool and marks it used.
+//
+// path: the path of the pool.
+// p: will store the prime.
+// bits: the size in bits of the prime to take.
+// e: if not NULL, only a prime p with p - 1 coprime to e is taken.
+// returns: true if a prime was taken, false if the pool has no such prime,
+//          does not exist or cannot be written.
+//
+bool primepool_take(const char *path, mpz_t p, uint64_t bits, mpz_t e);
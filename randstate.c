@@ -6,16 +6,28 @@
 // clang-format on
 #include <stdlib.h>
 
-gmp_randstate_t state;
-
 // initialize rand state with Mersenne Twister algorithm and setting random seed
-void randstate_init(uint64_t seed) {
-  srandom(seed);                // set seed for mpz random
-  gmp_randinit_mt(state);       // initialize gmp mersenne twister algorithm
-  gmp_randseed_ui(state, seed); // set seed for gmp random
+void randstate_init(randstate_t *rs, uint64_t seed) {
+  rs->seed = seed;
+  gmp_randinit_mt(rs->mt);       // initialize gmp mersenne twister algorithm
+  gmp_randseed_ui(rs->mt, seed); // set seed for gmp random
 }
 
 // clear and free memory used by randstate
-void randstate_clear(void) {
-  gmp_randclear(state); // clear gmp rand state
+void randstate_clear(randstate_t *rs) {
+  gmp_randclear(rs->mt); // clear gmp rand state
+}
+
+// splitmix64 finalizer, scrambling x into a well mixed 64 bit value
+static uint64_t mix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+// initialize a mersenne twister state seeded from the parent seed and stream
+void randstate_split(randstate_t *rs, const randstate_t *parent,
+                     uint64_t stream) {
+  randstate_init(rs, mix64(parent->seed ^ mix64(stream)));
 }
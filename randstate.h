@@ -5,19 +5,46 @@
 #include <gmp.h>
 // clang-format on
 
-extern gmp_randstate_t state;
+//
+// A random state: a Mersenne Twister and the seed it was started from.
+// Nothing in the RSA library or the number theory functions keeps random
+// state of its own; every function that needs random numbers takes one of
+// these. A state must only be used by one thread at a time, so each thread
+// splits its own from a shared parent.
+//
+typedef struct {
+  gmp_randstate_t mt; // the generator numbers are drawn from
+  uint64_t seed;      // the seed of mt, from which streams are split
+} randstate_t;
 
 //
-// Initializes the random state needed for RSA key generation operations.
-// Must be called before any key generation or number theory operations are
-// used.
+// Initializes a random state from a master seed.
+// Free it with randstate_clear().
 //
+// rs: the random state to initialize.
 // seed: the seed to seed the random state with.
 //
-void randstate_init(uint64_t seed);
+void randstate_init(randstate_t *rs, uint64_t seed);
 
 //
-// Frees any memory used by the initialized random state.
-// Must be called after all key generation or number theory operations are used.
+// Frees any memory used by an initialized random state.
+//
+// rs: the random state to clear.
+//
+void randstate_clear(randstate_t *rs);
+
+//
+// Initializes an independent random state for one stream split from a
+// parent. The child depends only on the parent's seed and the stream
+// number, never on what has been drawn from the parent, so the same master
+// seed and stream always produce the same sequence whatever other streams
+// are doing. The parent is only read, so threads may split from it at once,
+// and a child can be split again.
+// Free it with randstate_clear().
+//
+// rs: the random state to initialize.
+// parent: the random state to split from.
+// stream: the number of the stream to derive.
 //
-void randstate_clear(void);
+void randstate_split(randstate_t *rs, const randstate_t *parent,
+                     uint64_t stream);
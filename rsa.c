@@ -5,40 +5,188 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
 #include <unistd.h>
 #include "rsa.h"
+#include "chacha.h"
 #include "numtheory.h"
+#include "pool.h"
+#include "primepool.h"
 #include "randstate.h"
+#include "sha256.h"
+#include "stats.h"
 // clang-format on
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// source of primes for rsa_make_pub: a serial search drawing from rs when
+// pool is NULL, otherwise a parallel search over a fresh set of streams
+// split from rs per prime
+typedef struct {
+  pool_t *pool;
+  randstate_t *rs;
+  uint64_t next; // number of the next unused random stream
+} prime_source_t;
+
+// makes a prime of the given size from src
+static void prime_from(prime_source_t *src, mpz_t p, uint64_t bits,
+                       uint64_t iters) {
+  if (src->pool == NULL) {
+    make_prime(p, bits, iters, src->rs);
+    return;
+  }
+  make_prime_mt(p, bits, iters, src->pool, src->rs, src->next);
+  src->next += pool_threads(src->pool); // each search uses its own streams
+}
+
+// makes a prime of the given size such that e is coprime with p - 1
+static void make_prime_coprime(prime_source_t *src, mpz_t p, uint64_t bits,
+                               uint64_t iters, mpz_t e) {
+  mpz_t psub1, g;
+  mpz_inits(psub1, g, NULL);
+  do {
+    prime_from(src, p, bits, iters);
+    mpz_sub_ui(psub1, p, 1);
+    gcd(g, e, psub1);
+  } while (mpz_cmp_ui(g, 1) != 0);
+  mpz_clears(psub1, g, NULL);
+}
+
+// sets lamn to the least common multiple of lamn and p - 1
+static void lcm_psub1(mpz_t lamn, mpz_t p) {
+  mpz_t psub1, g;
+  mpz_inits(psub1, g, NULL);
+  mpz_sub_ui(psub1, p, 1); // psub1 = p - 1
+  gcd(g, lamn, psub1);
+  mpz_mul(lamn, lamn, psub1);
+  mpz_fdiv_q(lamn, lamn, g); // lamn = lamn (p - 1) / gcd(lamn, p - 1)
+  mpz_clears(psub1, g, NULL);
+}
+
 // creates parts of a new RSA public key: primes p and q, product n, public
 // exponent e
 void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits,
-                  uint64_t iters) {
-  uint64_t pbits = random() % ((2 * nbits)/4) + nbits/4;
-  uint64_t qbits = nbits - pbits;
-  make_prime(p, pbits + 1, iters); // make prime p
-  make_prime(q, qbits + 1, iters); // make prime q
-  mpz_mul(n, p, q);
-  mpz_t psub1, qsub1, phi_n, rand, d, lamn;
-  mpz_inits(psub1, qsub1, phi_n, rand, d, lamn,
-            NULL);               // initialize used mpz vars
-  mpz_sub_ui(psub1, p, 1);       // psub1 = p - 1
-  mpz_sub_ui(qsub1, q, 1);       // qsub1 = q - 1
-  mpz_mul(phi_n, psub1, qsub1);  // phi_n = (p-1)(q-1)
-  gcd(lamn, psub1, qsub1);       // store gcd(p-1)(q-1) in n
-  mpz_fdiv_q(lamn, phi_n, lamn); // n = phi_n / gcd(p-1)(q-1) 
+                  uint64_t iters, uint64_t pubexp, uint32_t threads,
+                  randstate_t *rs) {
+  mpz_t primes[2];
+  mpz_inits(primes[0], primes[1], NULL);
+  rsa_make_pub_multi(primes, 2, n, e, nbits, iters, pubexp, threads, NULL,
+                     rs);
+  mpz_swap(p, primes[0]);
+  mpz_swap(q, primes[1]);
+  mpz_clears(primes[0], primes[1], NULL);
+}
+
+// stores the balanced sizes of the nprimes primes of an nbits modulus
+void rsa_prime_sizes(uint64_t sizes[], uint64_t nbits, uint32_t nprimes) {
+  for (uint32_t i = 0; i < nprimes; i++) { // first nbits % nprimes one longer
+    sizes[i] = nbits / nprimes + (i < nbits % nprimes ? 1 : 0) + 1;
+  }
+}
+
+// stores the sizes of the nprimes primes of an nbits modulus, balanced
+// unless two primes may keep a random split
+static void prime_bits(prime_source_t *src, uint64_t bits[], uint64_t nbits,
+                       uint32_t nprimes, bool balanced) {
+  if (nprimes == 2 && !balanced) {
+    uint64_t pbits = gmp_urandomm_ui(src->rs->mt, (2 * nbits)/4) + nbits/4;
+    bits[0] = pbits + 1;
+    bits[1] = nbits - pbits + 1;
+  } else { // balanced, so a pool can hold primes of known sizes
+    rsa_prime_sizes(bits, nbits, nprimes);
+  }
+}
+
+// creates parts of a new RSA public key with nprimes primes of the given
+// sizes, their product n and public exponent e. the first given primes are
+// set by the caller; the rest are taken from primepool first if it is not
+// NULL, then drawn from src
+static void make_pub(prime_source_t *src, const uint64_t bits[],
+                     mpz_t primes[], uint32_t given, uint32_t nprimes,
+                     mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+                     uint64_t pubexp, const char *primepool) {
+  if (pubexp != 0) { // gcd(e, lambda(n)) = 1 iff e is coprime with each p-1
+    mpz_set_ui(e, pubexp);
+  }
+  mpz_set_ui(n, 1);
+  for (uint32_t i = 0; i < given; i++) {
+    mpz_mul(n, n, primes[i]);
+  }
+  for (uint32_t i = given; i < nprimes; i++) {
+    bool fresh;
+    do {
+      if (primepool != NULL &&
+          primepool_take(primepool, primes[i], bits[i],
+                         pubexp != 0 ? e : NULL)) {
+        // taken out of the pool, so it is never handed out again
+      } else if (pubexp != 0) {
+        make_prime_coprime(src, primes[i], bits[i], iters, e);
+      } else {
+        prime_from(src, primes[i], bits[i], iters);
+      }
+      fresh = true; // balanced sizes make a repeat possible for tiny keys
+      for (uint32_t j = 0; j < i && fresh; j++) {
+        fresh = mpz_cmp(primes[i], primes[j]) != 0;
+      }
+    } while (!fresh);
+    mpz_mul(n, n, primes[i]);
+  }
+  if (pubexp != 0) {
+    return;
+  }
+  mpz_t rand, d, lamn;
+  mpz_inits(rand, d, lamn, NULL); // initialize used mpz vars
+  mpz_set_ui(lamn, 1);
+  for (uint32_t i = 0; i < nprimes; i++) {
+    lcm_psub1(lamn, primes[i]); // lamn = lcm(p_1 - 1, ..., p_k - 1)
+  }
   while (true) {
-    mpz_urandomb(rand, state, nbits); // generate random num in rand mpz var
+    mpz_urandomb(rand, src->rs->mt, nbits); // generate random num in rand
     gcd(d, rand, lamn);          // check for gcd of generated rand num and n
     if (mpz_cmp_ui(d, 1) == 0) { // if rand num and n are coprime
       mpz_set(e, rand);          // set public exponent as rand
-      mpz_clears(psub1, qsub1, phi_n, rand, d, lamn, NULL); // clear mpzs
+      mpz_clears(rand, d, lamn, NULL); // clear mpzs
       return;
     }
   }
 }
 
+// creates parts of a new RSA public key with nprimes primes, their product n
+// and public exponent e, taking primes from primepool first if it is not NULL
+void rsa_make_pub_multi(mpz_t primes[], uint32_t nprimes, mpz_t n, mpz_t e,
+                        uint64_t nbits, uint64_t iters, uint64_t pubexp,
+                        uint32_t threads, const char *primepool,
+                        randstate_t *rs) {
+  prime_source_t src = { NULL, rs, 0 };
+  if (threads > 1) {
+    src.pool = pool_create(threads); // falls back to serial if NULL
+  }
+  uint64_t bits[RSA_MAX_PRIMES];
+  prime_bits(&src, bits, nbits, nprimes, primepool != NULL);
+  make_pub(&src, bits, primes, 0, nprimes, n, e, nbits, iters, pubexp,
+           primepool);
+  pool_delete(&src.pool);
+}
+
+// creates parts of a new RSA public key like rsa_make_pub_multi, keeping the
+// first given primes the caller took from a pool
+void rsa_make_pub_given(mpz_t primes[], uint32_t given, uint32_t nprimes,
+                        mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+                        uint64_t pubexp, uint32_t threads, randstate_t *rs) {
+  prime_source_t src = { NULL, rs, 0 };
+  if (threads > 1) {
+    src.pool = pool_create(threads); // falls back to serial if NULL
+  }
+  uint64_t bits[RSA_MAX_PRIMES];
+  prime_bits(&src, bits, nbits, nprimes, true);
+  make_pub(&src, bits, primes, given, nprimes, n, e, nbits, iters, pubexp,
+           NULL);
+  pool_delete(&src.pool);
+}
+
 // writes public RSA key to pbfile
 void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
   gmp_fprintf(pbfile, "%Zx\n%Zx\n%Zx\n", n, e, s);
@@ -46,8 +194,8 @@ void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
 }
 
 // reads a public RSA key from pbfile
-void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
-  gmp_fscanf(pbfile, "%Zx\n%Zx\n%Zx\n%s\n", n, e, s, username);
+bool rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
+  return gmp_fscanf(pbfile, "%Zx\n%Zx\n%Zx\n%s\n", n, e, s, username) == 4;
 }
 
 // creates a new RSA private key given p, q, and e
@@ -63,109 +211,1348 @@ void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q) {
   mpz_clears(lamn, psub1, qsub1, phi_n, NULL); // clear mpzs
 }
 
+// creates the private exponent of a key with nprimes primes
+void rsa_make_priv_multi(mpz_t d, mpz_t e, mpz_t primes[], uint32_t nprimes) {
+  mpz_t lamn;
+  mpz_init_set_ui(lamn, 1);
+  for (uint32_t i = 0; i < nprimes; i++) {
+    lcm_psub1(lamn, primes[i]); // lamn = lcm(p_1 - 1, ..., p_k - 1)
+  }
+  mod_inverse(d, e, lamn);
+  mpz_clear(lamn);
+}
+
+#define PRIV_MAGIC   "#rsa-priv" // header line of versioned private key files
+#define PRIV_VERSION 2           // version 2 adds p, q and the CRT components
+#define PRIV_MULTI   3           // version 3 adds the primes after p and q
+
+// initializes every component of a private key
+void rsa_priv_init(rsa_priv_t *key) {
+  mpz_inits(key->n, key->d, key->p, key->q, key->dp, key->dq, key->qinv, NULL);
+  for (int i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+    mpz_inits(key->r[i], key->dr[i], key->rinv[i], NULL);
+  }
+  key->nprimes = 2;
+  key->crt = false;
+}
+
+// clears every component of a private key
+void rsa_priv_clear(rsa_priv_t *key) {
+  mpz_clears(key->n, key->d, key->p, key->q, key->dp, key->dq, key->qinv,
+             NULL);
+  for (int i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+    mpz_clears(key->r[i], key->dr[i], key->rinv[i], NULL);
+  }
+  key->crt = false;
+}
+
+// fills in a private key from n, d, p and q, precomputing the CRT components
+void rsa_priv_set(rsa_priv_t *key, mpz_t n, mpz_t d, mpz_t p, mpz_t q) {
+  key->nprimes = 2;
+  mpz_set(key->n, n);
+  mpz_set(key->d, d);
+  mpz_set(key->p, p);
+  mpz_set(key->q, q);
+  mpz_sub_ui(key->dp, p, 1);
+  mpz_mod(key->dp, d, key->dp); // dp = d mod (p - 1)
+  mpz_sub_ui(key->dq, q, 1);
+  mpz_mod(key->dq, d, key->dq); // dq = d mod (q - 1)
+  mod_inverse(key->qinv, q, p); // qinv = q^-1 mod p
+  key->crt = mpz_cmp_ui(key->qinv, 0) != 0; // 0 only if p, q share a factor
+}
+
+// fills in a private key from n, d and nprimes primes, precomputing the CRT
+// components of every prime
+void rsa_priv_set_multi(rsa_priv_t *key, mpz_t n, mpz_t d, mpz_t primes[],
+                        uint32_t nprimes) {
+  rsa_priv_set(key, n, d, primes[0], primes[1]);
+  key->nprimes = nprimes;
+  mpz_t prod;
+  mpz_init(prod);
+  mpz_mul(prod, primes[0], primes[1]);
+  for (uint32_t i = 2; i < nprimes; i++) {
+    mpz_ptr r = key->r[i - 2], dr = key->dr[i - 2], rinv = key->rinv[i - 2];
+    mpz_set(r, primes[i]);
+    mpz_sub_ui(dr, r, 1);
+    mpz_mod(dr, d, dr);         // dr = d mod (r - 1)
+    mod_inverse(rinv, prod, r); // rinv = (p q r_3 ... r_(i-1))^-1 mod r
+    key->crt = key->crt && mpz_cmp_ui(rinv, 0) != 0;
+    mpz_mul(prod, prod, r);
+  }
+  mpz_clear(prod);
+}
+
 // writes private RSA key to pvfile
-void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile) {
-  gmp_fprintf(pvfile, "%Zx\n%Zx\n", n, d);
+void rsa_write_priv(rsa_priv_t *key, FILE *pvfile) {
+  if (!key->crt) { // without primes only the legacy format can be written
+    gmp_fprintf(pvfile, "%Zx\n%Zx\n", key->n, key->d);
+    return;
+  }
+  if (key->nprimes > 2) {
+    fprintf(pvfile, "%s v%d %" PRIu32 "\n", PRIV_MAGIC, PRIV_MULTI,
+            key->nprimes);
+  } else { // two-prime keys stay readable by older versions
+    fprintf(pvfile, "%s v%d\n", PRIV_MAGIC, PRIV_VERSION);
+  }
+  gmp_fprintf(pvfile, "%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n", key->n, key->d,
+              key->p, key->q, key->dp, key->dq, key->qinv);
+  for (uint32_t i = 0; i + 2 < key->nprimes; i++) {
+    gmp_fprintf(pvfile, "%Zx\n%Zx\n%Zx\n", key->r[i], key->dr[i],
+                key->rinv[i]);
+  }
+}
+
+// reads a private RSA key from pvfile, falling back to the legacy n, d format
+bool rsa_read_priv(rsa_priv_t *key, FILE *pvfile) {
+  key->crt = false;
+  key->nprimes = 2;
+  int c = fgetc(pvfile);
+  if (c != '#') { // legacy files start directly with the hex modulus
+    ungetc(c, pvfile);
+    return gmp_fscanf(pvfile, "%Zx\n%Zx\n", key->n, key->d) == 2;
+  }
+  ungetc(c, pvfile);
+  int version = 0;
+  if (fscanf(pvfile, PRIV_MAGIC " v%d", &version) != 1 ||
+      (version != PRIV_VERSION && version != PRIV_MULTI)) {
+    return false; // unknown header or version
+  }
+  if (version == PRIV_MULTI &&
+      (fscanf(pvfile, " %" SCNu32, &key->nprimes) != 1 ||
+       key->nprimes < 3 || key->nprimes > RSA_MAX_PRIMES)) {
+    return false;
+  }
+  if (gmp_fscanf(pvfile, "%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n", key->n,
+                 key->d, key->p, key->q, key->dp, key->dq, key->qinv) != 7) {
+    return false;
+  }
+  mpz_t t;
+  mpz_init(t);
+  mpz_mul(t, key->p, key->q);
+  for (uint32_t i = 0; i + 2 < key->nprimes; i++) {
+    if (gmp_fscanf(pvfile, "%Zx\n%Zx\n%Zx\n", key->r[i], key->dr[i],
+                   key->rinv[i]) != 3) {
+      mpz_clear(t);
+      return false;
+    }
+    mpz_mul(t, t, key->r[i]);
+  }
+  key->crt = mpz_cmp(t, key->n) == 0; // only trust CRT parts if the primes
+  mpz_clear(t);                       // multiply to n
+  return true;
+}
+
+// initializes scratch sized for key, prepared for its moduli and holding
+// the plans of its exponents
+void rsa_ctx_init(rsa_ctx_t *ctx, rsa_priv_t *key) {
+  size_t bits = mpz_sizeinbase(key->n, 2);
+  nt_ctx_init(&ctx->nt, bits);
+  nt_exp_init(&ctx->xd);
+  nt_exp_init(&ctx->xp);
+  nt_exp_init(&ctx->xq);
+  for (int i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+    nt_exp_init(&ctx->xr[i]);
+  }
+  if (key->crt) {
+    nt_ctx_prepare(&ctx->nt, key->p);
+    nt_ctx_prepare(&ctx->nt, key->q);
+    nt_exp_set(&ctx->xp, key->dp);
+    nt_exp_set(&ctx->xq, key->dq);
+    for (uint32_t i = 0; i + 2 < key->nprimes; i++) {
+      nt_ctx_prepare(&ctx->nt, key->r[i]);
+      nt_exp_set(&ctx->xr[i], key->dr[i]);
+    }
+  } else {
+    nt_ctx_prepare(&ctx->nt, key->n);
+    nt_exp_set(&ctx->xd, key->d);
+  }
+  mpz_init2(ctx->m1, bits);
+  mpz_init2(ctx->m2, bits);
+  mpz_init2(ctx->h, 2 * bits);
+  for (int i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+    mpz_init2(ctx->mr[i], bits);
+  }
+  mpz_init2(ctx->prod, bits);
+}
+
+// frees the memory used by scratch
+void rsa_ctx_clear(rsa_ctx_t *ctx) {
+  nt_ctx_clear(&ctx->nt);
+  mpz_clears(ctx->m1, ctx->m2, ctx->h, ctx->prod, NULL);
+  nt_exp_clear(&ctx->xd);
+  nt_exp_clear(&ctx->xp);
+  nt_exp_clear(&ctx->xq);
+  for (int i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+    mpz_clear(ctx->mr[i]);
+    nt_exp_clear(&ctx->xr[i]);
+  }
+}
+
+// computes o = a^d mod n with the CRT components of key, recombining any
+// extra primes with garner's algorithm
+static void rsa_crt_pow(mpz_t o, mpz_t a, rsa_priv_t *key, rsa_ctx_t *ctx) {
+  mpz_ptr m1 = ctx->m1, m2 = ctx->m2, h = ctx->h;
+  uint32_t extra = key->nprimes - 2;
+  mpz_mod(m1, a, key->p);
+  pow_mod_exp_ctx(m1, m1, &ctx->xp, key->p, &ctx->nt); // m1 = a^dp mod p
+  mpz_mod(m2, a, key->q);
+  pow_mod_exp_ctx(m2, m2, &ctx->xq, key->q, &ctx->nt); // m2 = a^dq mod q
+  for (uint32_t i = 0; i < extra; i++) { // before o, which may alias a
+    mpz_mod(ctx->mr[i], a, key->r[i]);
+    pow_mod_exp_ctx(ctx->mr[i], ctx->mr[i], &ctx->xr[i], key->r[i],
+                    &ctx->nt);
+  }
+  mpz_sub(h, m1, m2);
+  mpz_mul(h, h, key->qinv);
+  mpz_mod(h, h, key->p); // h = qinv (m1 - m2) mod p
+  mpz_mul(h, h, key->q);
+  mpz_add(o, m2, h); // o = m2 + h q
+  if (extra == 0) {
+    return;
+  }
+  mpz_mul(ctx->prod, key->p, key->q);
+  for (uint32_t i = 0; i < extra; i++) {
+    mpz_sub(h, ctx->mr[i], o);
+    mpz_mul(h, h, key->rinv[i]);
+    mpz_mod(h, h, key->r[i]); // h = rinv (m_i - o) mod r_i
+    mpz_mul(h, h, ctx->prod);
+    mpz_add(o, o, h); // o = o + h p q r_3 ... r_(i-1)
+    if (i + 1 < extra) {
+      mpz_mul(ctx->prod, ctx->prod, key->r[i]);
+    }
+  }
 }
 
-// reads a private RSA key from pvfile
-void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile) {
-  gmp_fscanf(pvfile, "%Zx\n%Zx\n", n, d);
+// computes o = a^d mod n for the private exponent d of key
+static void rsa_priv_pow(mpz_t o, mpz_t a, rsa_priv_t *key, rsa_ctx_t *ctx) {
+  if (key->crt) {
+    rsa_crt_pow(o, a, key, ctx);
+  } else {
+    pow_mod_exp_ctx(o, a, &ctx->xd, key->n, &ctx->nt);
+  }
 }
 
 // performs RSA encryption, computing ciphertext c
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n) { pow_mod(c, m, e, n); }
 
-// encrypts contents of infile, writing encrypted contents to outfile
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
-  mpz_t m, c, mk;
-  mpz_inits(m, c, mk,
-            NULL); // initialize mpz m for message and mpz c for ciphertext
-  uint64_t logn = mpz_sizeinbase(n, 2) - 1; // logn = log base 2 (n) - 1
-  mpz_set_ui(mk, logn);
-  mpz_fdiv_q_ui(mk, mk, 8); // k = floordiv(log base 2 (n) - 1)/8
-  uint64_t k = mpz_get_ui(mk);
-  uint64_t b = 0;             // bytes
-  fseek(infile, 0, SEEK_END); // seek end of file and ask for position (to find
-                              // number of bytes)
-  b = ftell(infile);          // check for total number of bytes in infile
-  fseek(infile, 0, SEEK_SET); // set position in file to beginning
-  uint64_t bleft = 0;         // bytes left to read
-  size_t bytes_read = 1;      // number of bytes actually read
-  uint64_t i = 1;             // index
-  while (
-      bytes_read >
-      0) { // while not at end of file or there are unprocessed bytes in infile
-    uint8_t *block = (uint8_t *)calloc(
-        k, sizeof(uint8_t)); // dynamically allocate array of k bytes
-    if (!block) {            // if block is empty
-      free(block);
-      block = NULL; // clear block
+#define BIN_MAGIC   "RSAB"     // first bytes of a binary ciphertext file
+#define BIN_VERSION 1          // version of the binary layout
+#define BIN_HEADER  32         // bytes in the binary header
+#define BIN_UNKNOWN UINT64_MAX // header count/length when output was a pipe
+
+#define HYB_MAGIC    "RSAH"      // first bytes of a hybrid ciphertext file
+#define HYB_VERSION  2           // version of the hybrid layout
+#define HYB_HEADER   16          // bytes in the hybrid header
+#define HYB_CHUNK    (1 << 16)   // plaintext bytes per sealed chunk
+#define HYB_FINAL    0x80000000u // chunk header bit marking the last chunk
+#define HYB_MIN_BITS 264         // smallest n whose z outweighs the key
+
+// stores v big-endian in the first bytes bytes of p
+static void put_be(uint8_t *p, uint64_t v, int bytes) {
+  for (int i = bytes - 1; i >= 0; i--) {
+    p[i] = v & 0xFF;
+    v >>= 8;
+  }
+}
+
+// loads a big-endian value from the first bytes bytes of p
+static uint64_t get_be(const uint8_t *p, int bytes) {
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; i++) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+// fills a binary header: magic, version, record width, reserved, record
+// count and plaintext length
+static void bin_header(uint8_t h[BIN_HEADER], size_t width, uint64_t blocks,
+                       uint64_t length) {
+  memcpy(h, BIN_MAGIC, 4);
+  put_be(h + 4, BIN_VERSION, 4);
+  put_be(h + 8, width, 4);
+  put_be(h + 12, 0, 4);
+  put_be(h + 16, blocks, 8);
+  put_be(h + 24, length, 8);
+}
+
+#define CT_BUFFER (1 << 20) // bytes ciphertext readers and writers buffer
+
+static const char hex_digits[] = "0123456789abcdef";
+
+#ifdef __SSE2__
+// turns 16 nibbles into their lowercase hex digits
+static inline __m128i hex_digits_sse2(__m128i v) {
+  __m128i letters = _mm_cmpgt_epi8(v, _mm_set1_epi8(9));
+  v = _mm_add_epi8(v, _mm_set1_epi8('0'));
+  return _mm_add_epi8(v, _mm_and_si128(letters, _mm_set1_epi8('a' - '9' - 1)));
+}
+#endif
+
+// writes the 2 len lowercase hex digits of the bytes in src to dst
+static void hex_encode(char *dst, const uint8_t *src, size_t len) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i mask = _mm_set1_epi8(0x0F);
+  for (; i + 16 <= len; i += 16) { // 16 bytes become 32 digits at a time
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+    __m128i lo = _mm_and_si128(v, mask);
+    _mm_storeu_si128((__m128i *)(dst + 2 * i),
+                     hex_digits_sse2(_mm_unpacklo_epi8(hi, lo)));
+    _mm_storeu_si128((__m128i *)(dst + 2 * i + 16),
+                     hex_digits_sse2(_mm_unpackhi_epi8(hi, lo)));
+  }
+#endif
+  for (; i < len; i++) {
+    dst[2 * i] = hex_digits[src[i] >> 4];
+    dst[2 * i + 1] = hex_digits[src[i] & 0x0F];
+  }
+}
+
+// stores the limbs of c >= 0 in rec as big-endian bytes, faster than
+// mpz_export; returns a pointer to the first nonzero byte and stores the
+// number of bytes from there in len
+static const uint8_t *limbs_be(uint8_t *rec, mpz_t c, size_t *len) {
+  size_t nl = mpz_size(c);
+  const mp_limb_t *lp = mpz_limbs_read(c);
+  uint8_t *p = rec;
+  for (size_t i = nl; i-- > 0;) {
+    for (int b = GMP_NUMB_BITS - 8; b >= 0; b -= 8) {
+      *p++ = (uint8_t)(lp[i] >> b);
     }
-    block[0] = 0xFF; // set 0th index(byte) of block as 0xFF
-    if (b >= b - (k - 1)) {   // if bytes in file >= bytes in file - (size of block - 1)
-      bleft = k - 1; // read k - 1 bytes
-    } else {
-      bleft = b - i; // do not read k - 1 bytes
+  }
+  const uint8_t *first = rec;
+  while (first < p && *first == 0) {
+    first++;
+  }
+  *len = p - first;
+  return first;
+}
+
+// writes ciphertext records in the chosen format through one large buffer,
+// tracking the totals that go into the binary header
+typedef struct {
+  FILE *outfile;
+  rsa_format_t format;
+  size_t width;    // bytes per binary record
+  uint8_t *rec;    // scratch for the limbs of one ciphertext
+  uint8_t *buf;    // records not yet written to outfile
+  size_t used;     // bytes in buf
+  uint64_t blocks; // records written
+  uint64_t length; // plaintext bytes covered by the records
+  off_t start;     // offset of the binary header, or -1 if not seekable
+} ct_writer_t;
+
+// sets up a writer for ciphertexts modulo n, writing the binary header
+static void ct_writer_init(ct_writer_t *w, FILE *outfile, rsa_format_t format,
+                           mpz_t n) {
+  w->outfile = outfile;
+  w->format = format;
+  w->width = mpz_sizeinbase(n, 256);
+  w->rec = (uint8_t *)malloc(mpz_size(n) * sizeof(mp_limb_t));
+  w->buf = (uint8_t *)malloc(CT_BUFFER);
+  w->used = 0;
+  w->blocks = 0;
+  w->length = 0;
+  w->start = -1;
+  if (format == RSA_FORMAT_BIN) {
+    w->start = ftello(outfile);
+    uint8_t h[BIN_HEADER];
+    bin_header(h, w->width, BIN_UNKNOWN, BIN_UNKNOWN); // patched when done
+    fwrite(h, sizeof(uint8_t), BIN_HEADER, outfile);
+    stats_add(STAT_BYTES_OUT, BIN_HEADER);
+  }
+}
+
+// writes the buffered records to outfile
+static void ct_flush(ct_writer_t *w) {
+  fwrite(w->buf, sizeof(uint8_t), w->used, w->outfile);
+  w->used = 0;
+}
+
+// writes ciphertext c of a block holding len plaintext bytes
+static void ct_write(ct_writer_t *w, mpz_t c, size_t len) {
+  uint64_t start = stats_start();
+  w->blocks++;
+  w->length += len;
+  stats_add(STAT_BLOCKS, 1);
+  if (CT_BUFFER - w->used < 2 * w->width + 1) { // room for the longest record
+    ct_flush(w);
+  }
+  uint8_t *out = w->buf + w->used;
+  size_t bytes;
+  const uint8_t *src = limbs_be(w->rec, c, &bytes); // c < n, so fits width
+  if (w->format == RSA_FORMAT_BIN) {
+    memset(out, 0, w->width - bytes); // left pad to the fixed width
+    memcpy(out + w->width - bytes, src, bytes);
+    w->used += w->width;
+    stats_add(STAT_BYTES_OUT, w->width);
+    stats_stop(STAT_IO, start);
+    return;
+  }
+  char *hex = (char *)out;
+  size_t digits = 0;
+  if (bytes == 0 || src[0] < 0x10) { // like %Zx, no leading zero digit
+    hex[digits++] = hex_digits[bytes == 0 ? 0 : src[0]];
+    src += bytes > 0;
+    bytes -= bytes > 0;
+  }
+  hex_encode(hex + digits, src, bytes);
+  digits += 2 * bytes;
+  hex[digits++] = '\n';
+  w->used += digits;
+  stats_add(STAT_BYTES_OUT, digits);
+  stats_stop(STAT_IO, start);
+}
+
+// fills in the binary header totals if the output can be rewound
+static void ct_writer_finish(ct_writer_t *w) {
+  ct_flush(w);
+  if (w->format == RSA_FORMAT_BIN && w->start >= 0) {
+    off_t end = ftello(w->outfile);
+    if (fseeko(w->outfile, w->start, SEEK_SET) == 0) {
+      uint8_t h[BIN_HEADER];
+      bin_header(h, w->width, w->blocks, w->length);
+      fwrite(h, sizeof(uint8_t), BIN_HEADER, w->outfile);
+      fseeko(w->outfile, end, SEEK_SET);
+    }
+  }
+  free(w->rec);
+  free(w->buf);
+  w->rec = NULL;
+  w->buf = NULL;
+}
+
+#define READ_CHUNK (1 << 20) // bytes requested from the input per read
+
+// splits an input stream into blocks through one large reusable buffer, so
+// that input is consumed in big reads and never needs to be seekable
+typedef struct {
+  FILE *infile;
+  uint8_t *buf;
+  size_t size; // capacity of buf
+  size_t len;  // bytes of buf holding input
+  size_t pos;  // bytes of buf already handed out
+  bool eof;    // true once infile has no more input
+} block_reader_t;
+
+// sets up a reader handing out blocks of at most block bytes
+static void block_reader_init(block_reader_t *r, FILE *infile, size_t block) {
+  r->infile = infile;
+  r->size = READ_CHUNK > block ? READ_CHUNK - READ_CHUNK % block : block;
+  r->buf = (uint8_t *)malloc(r->size);
+  r->len = 0;
+  r->pos = 0;
+  r->eof = false;
+}
+
+// frees the reader buffer
+static void block_reader_free(block_reader_t *r) {
+  free(r->buf);
+  r->buf = NULL;
+}
+
+// copies the next block of want bytes into dst. the block is only shorter
+// than want at the end of the input; returns its length, or 0 at the end
+static size_t block_read(block_reader_t *r, uint8_t *dst, size_t want) {
+  if (r->len - r->pos < want && !r->eof) { // refill behind the unread tail
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+    uint64_t start = stats_start();
+    while (r->len < r->size && !r->eof) { // fread is only short at the end
+      size_t got = fread(r->buf + r->len, sizeof(uint8_t), r->size - r->len,
+                         r->infile);
+      r->len += got;
+      r->eof = got == 0 || feof(r->infile) || ferror(r->infile);
+      stats_add(STAT_BYTES_IN, got);
     }
-    if (bleft == 0) { // if there are no bytes left to read
-      free(block);
-      block = NULL; // clear block
+    stats_stop(STAT_IO, start);
+  }
+  size_t n = r->len - r->pos < want ? r->len - r->pos : want;
+  memcpy(dst, r->buf + r->pos, n);
+  r->pos += n;
+  return n;
+}
+
+#define ENC_BATCH 64 // blocks per worker thread in each parallel batch
+
+// a batch of plaintext blocks and their ciphertexts for parallel encryption
+typedef struct {
+  uint8_t *blocks;   // count blocks of k bytes, each starting with 0xFF
+  size_t *lens;      // number of input bytes in each block
+  mpz_t *c;          // ciphertext of each block
+  uint64_t count;    // number of blocks filled
+  uint64_t k;        // block size
+  mpz_ptr n;         // public modulus
+  const nt_exp_t *e; // plan of the public exponent
+  nt_ctx_t *ctx;     // scratch of each worker
+} enc_batch_t;
+
+// encrypts block i of an enc_batch_t (run on a pool worker)
+static void enc_batch_job(void *arg, uint64_t i, uint32_t worker) {
+  enc_batch_t *b = (enc_batch_t *)arg;
+  uint64_t start = stats_start();
+  mpz_import(b->c[i], b->lens[i] + 1, 1, 1, 1, 0, b->blocks + i * b->k);
+  pow_mod_exp_ctx(b->c[i], b->c[i], b->e, b->n, &b->ctx[worker]);
+  stats_stop(STAT_MATH, start);
+}
+
+// fills a batch with up to max blocks of k - 1 bytes from the input
+static void enc_batch_read(enc_batch_t *b, uint64_t max, block_reader_t *r) {
+  b->count = 0;
+  while (b->count < max) {
+    uint8_t *block = b->blocks + b->count * b->k;
+    block[0] = 0xFF; // prepend 0xFF so leading zero bytes survive the import
+    size_t bytes_read = block_read(r, block + 1, b->k - 1);
+    if (bytes_read == 0) { // end of file
       break;
     }
-    bytes_read =
-        fread(block + 1, sizeof(uint8_t), bleft,
-              infile); // bytes_read = number of bytes read through fread
-    i += bytes_read;   // increment index by number of bytes read
-    mpz_import(m, bytes_read + 1, 1, 1, 1, 0,
-               block);       // import block and create m
-    rsa_encrypt(c, m, e, n); // encrypt m into ciphertext c
-    gmp_fprintf(outfile, "%Zx\n",
-                c); // print ciphertext to outfile as hexstring
+    b->lens[b->count++] = bytes_read;
+  }
+}
+
+// encrypts infile with a pool of worker threads; blocks are read and written
+// in batches so that I/O on one batch overlaps the arithmetic on the next
+static bool rsa_encrypt_file_mt(block_reader_t *r, ct_writer_t *w, mpz_t n,
+                                const nt_exp_t *e, uint64_t k,
+                                uint32_t threads) {
+  pool_t *pool = pool_create(threads);
+  if (pool == NULL) {
+    return false;
+  }
+  uint64_t max = (uint64_t)threads * ENC_BATCH;
+  nt_ctx_t *ctx = (nt_ctx_t *)malloc(threads * sizeof(nt_ctx_t));
+  for (uint32_t i = 0; i < threads; i++) {
+    nt_ctx_init(&ctx[i], mpz_sizeinbase(n, 2));
+    nt_ctx_prepare(&ctx[i], n);
+  }
+  enc_batch_t batches[2];
+  for (int b = 0; b < 2; b++) {
+    batches[b].blocks = (uint8_t *)malloc(max * k);
+    batches[b].lens = (size_t *)malloc(max * sizeof(size_t));
+    batches[b].c = (mpz_t *)malloc(max * sizeof(mpz_t));
+    batches[b].k = k;
+    batches[b].n = n;
+    batches[b].e = e;
+    batches[b].ctx = ctx;
+    for (uint64_t i = 0; i < max; i++) {
+      mpz_init(batches[b].c[i]);
+    }
+  }
+
+  enc_batch_t *cur = &batches[0];
+  enc_batch_t *next = &batches[1];
+  enc_batch_read(cur, max, r);
+  if (cur->count > 0) {
+    pool_start(pool, enc_batch_job, cur, cur->count);
+    while (true) {
+      enc_batch_read(next, max, r); // read ahead while cur is encrypted
+      pool_wait(pool);
+      if (next->count > 0) {
+        pool_start(pool, enc_batch_job, next, next->count);
+      }
+      for (uint64_t i = 0; i < cur->count; i++) { // write cur in input order
+        ct_write(w, cur->c[i], cur->lens[i]);
+      }
+      if (next->count == 0) {
+        break;
+      }
+      enc_batch_t *t = cur;
+      cur = next;
+      next = t;
+    }
+  }
+
+  pool_delete(&pool);
+  for (int b = 0; b < 2; b++) {
+    for (uint64_t i = 0; i < max; i++) {
+      mpz_clear(batches[b].c[i]);
+    }
+    free(batches[b].blocks);
+    free(batches[b].lens);
+    free(batches[b].c);
+  }
+  for (uint32_t i = 0; i < threads; i++) {
+    nt_ctx_clear(&ctx[i]);
+  }
+  free(ctx);
+  return true;
+}
+
+// fills buf with len bytes from the system random source
+static bool random_bytes(uint8_t *buf, size_t len) {
+  FILE *f = fopen("/dev/urandom", "rb");
+  if (f == NULL) {
+    return false;
+  }
+  bool ok = fread(buf, sizeof(uint8_t), len, f) == len;
+  fclose(f);
+  return ok;
+}
+
+// stores why encryption failed in err if it is not NULL; returns false
+static bool enc_fail(rsa_error_t *err, const char *reason) {
+  if (err != NULL) {
+    err->offset = 0;
+    err->reason = reason;
+  }
+  return false;
+}
+
+// derives the session key from the width byte block z that was wrapped,
+// as KDF2 with SHA-256
+static void hybrid_kdf(uint8_t skey[CHACHA_KEY_BYTES], const uint8_t *z,
+                       size_t width) {
+  static const uint8_t counter[4] = { 0, 0, 0, 1 };
+  sha256_pair(skey, z, width, counter, sizeof(counter));
+}
+
+// encrypts infile in hybrid mode, as RSA-KEM: a fresh random z below n is
+// wrapped with rsa_encrypt, and the payload is sealed in ChaCha20-Poly1305
+// chunks under a session key derived from z
+static bool hybrid_encrypt(block_reader_t *r, FILE *outfile, mpz_t n,
+                           mpz_t e, rsa_error_t *err) {
+  size_t width = mpz_sizeinbase(n, 256);
+  size_t nbits = mpz_sizeinbase(n, 2);
+  if (nbits < HYB_MIN_BITS) { // z would hold less entropy than the key
+    return enc_fail(err, "modulus too small for hybrid mode, which needs "
+                         "at least 264 bits");
+  }
+  uint8_t *zb = (uint8_t *)malloc(width);
+  mpz_t z;
+  mpz_init(z);
+  bool ok;
+  do { // uniform in [2, n) by rejection, less than two draws on average
+    ok = random_bytes(zb, width);
+    zb[0] &= 0xFF >> (8 * width - nbits);
+    mpz_import(z, width, 1, 1, 1, 0, zb);
+  } while (ok && (mpz_cmp(z, n) >= 0 || mpz_cmp_ui(z, 1) <= 0));
+  if (!ok) {
+    mpz_clear(z);
+    free(zb);
+    return enc_fail(err, "no random bytes for the hybrid session key");
+  }
+  uint8_t skey[CHACHA_KEY_BYTES];
+  hybrid_kdf(skey, zb, width);
+  memset(zb, 0, width);
+  free(zb);
+  uint8_t *rec = (uint8_t *)calloc(width, sizeof(uint8_t));
+  uint8_t *chunk = (uint8_t *)malloc(HYB_CHUNK + CHACHA_TAG_BYTES);
+  rsa_encrypt(z, z, e, n); // the only RSA operation for the whole file
+  size_t bytes = mpz_sizeinbase(z, 256);
+  mpz_export(rec + width - bytes, NULL, 1, 1, 1, 0, z);
+  mpz_clear(z);
+
+  uint8_t h[HYB_HEADER];
+  memcpy(h, HYB_MAGIC, 4);
+  put_be(h + 4, HYB_VERSION, 4);
+  put_be(h + 8, width, 4);
+  put_be(h + 12, 0, 4);
+  fwrite(h, sizeof(uint8_t), HYB_HEADER, outfile);
+  fwrite(rec, sizeof(uint8_t), width, outfile);
+  stats_add(STAT_BYTES_OUT, HYB_HEADER + width);
+
+  bool final = false;
+  for (uint64_t i = 0; !final; i++) {
+    size_t len = block_read(r, chunk, HYB_CHUNK);
+    final = len < HYB_CHUNK; // a full last chunk is followed by an empty one
+    uint8_t hdr[4];
+    put_be(hdr, len | (final ? HYB_FINAL : 0), 4);
+    uint8_t nonce[CHACHA_NONCE_BYTES] = { 0 };
+    put_be(nonce + 4, i, 8);
+    uint64_t start = stats_start();
+    chacha20_poly1305_seal(chunk, len, hdr, sizeof(hdr), skey, nonce,
+                           chunk + len);
+    stats_stop(STAT_MATH, start);
+    start = stats_start();
+    fwrite(hdr, sizeof(uint8_t), sizeof(hdr), outfile);
+    fwrite(chunk, sizeof(uint8_t), len + CHACHA_TAG_BYTES, outfile);
+    stats_stop(STAT_IO, start);
+    stats_add(STAT_BLOCKS, 1);
+    stats_add(STAT_BYTES_OUT, sizeof(hdr) + len + CHACHA_TAG_BYTES);
+  }
+  memset(skey, 0, sizeof(skey));
+  free(rec);
+  free(chunk);
+  return true;
+}
+
+// encrypts contents of infile, writing encrypted contents to outfile. the
+// input is streamed through one reusable buffer, so pipes and inputs of any
+// size are encrypted in constant memory
+bool rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e,
+                      uint32_t threads, rsa_format_t format,
+                      rsa_error_t *err) {
+  uint64_t k = (mpz_sizeinbase(n, 2) - 1) / 8; // k = floor((log2(n) - 1) / 8)
+  block_reader_t r;
+  if (format == RSA_FORMAT_HYBRID) {
+    block_reader_init(&r, infile, HYB_CHUNK);
+    bool ok = hybrid_encrypt(&r, outfile, n, e, err);
+    block_reader_free(&r);
+    return ok;
+  }
+  mpz_t m, c;
+  mpz_inits(m, c,
+            NULL); // initialize mpz m for message and mpz c for ciphertext
+  block_reader_init(&r, infile, k - 1);
+  ct_writer_t w;
+  ct_writer_init(&w, outfile, format, n);
+  nt_exp_t plan; // e is recoded once for every block
+  nt_exp_init(&plan);
+  nt_exp_set(&plan, e);
+  if (threads <= 1 || !rsa_encrypt_file_mt(&r, &w, n, &plan, k, threads)) {
+    nt_ctx_t ctx;
+    nt_ctx_init(&ctx, mpz_sizeinbase(n, 2));
+    nt_ctx_prepare(&ctx, n);
+    uint8_t *block = (uint8_t *)malloc(k); // one block reused for all input
+    block[0] = 0xFF; // set 0th index(byte) of block as 0xFF
+    size_t bytes_read = 0;
+    while ((bytes_read = block_read(&r, block + 1, k - 1)) > 0) {
+      uint64_t start = stats_start();
+      mpz_import(m, bytes_read + 1, 1, 1, 1, 0,
+                 block);           // import block and create m
+      pow_mod_exp_ctx(c, m, &plan, n, &ctx); // encrypt m into ciphertext c
+      stats_stop(STAT_MATH, start);
+      ct_write(&w, c, bytes_read); // write ciphertext to outfile
+    }
     free(block);
-    block = NULL; // clear block
+    nt_ctx_clear(&ctx);
   }
+  nt_exp_clear(&plan);
+  ct_writer_finish(&w);
+  block_reader_free(&r);
   mpz_clears(m, c, NULL); // clear used mpzs
+  return true;
 }
 
 // performs rsa decryption, computing msg m by decrypting ciphertext c using
-// priv key d and pub modulus n
-void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) { pow_mod(m, c, d, n); }
+// priv key
+void rsa_decrypt(mpz_t m, mpz_t c, rsa_priv_t *key) {
+  rsa_ctx_t ctx;
+  rsa_ctx_init(&ctx, key);
+  rsa_priv_pow(m, c, key, &ctx);
+  rsa_ctx_clear(&ctx);
+}
 
-// decrypts the content of infile, writing the decrypted contents to outfile
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
-  mpz_t c, m, mk;
-  mpz_inits(c, m, mk, NULL);                // initialize used mpz vars
-  uint64_t logn = mpz_sizeinbase(n, 2) - 1; // logn = log base 2 (n) - 1
-  mpz_set_ui(mk, logn);
-  mpz_fdiv_q_ui(mk, mk, 8); // k = floordiv(log base 2 (n) - 1)/8
-  uint64_t k = mpz_get_ui(mk);
+#define HEX_SPACE 17 // hex_value of whitespace allowed in hex records
+
+// the value plus one of each hex digit, HEX_SPACE for whitespace and 0 for
+// every other byte
+static const uint8_t hex_value[256] = {
+  ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,  ['5'] = 6,
+  ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10, ['a'] = 11, ['b'] = 12,
+  ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16, ['A'] = 11, ['B'] = 12,
+  ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16, [' '] = HEX_SPACE,
+  ['\t'] = HEX_SPACE, ['\r'] = HEX_SPACE, ['\v'] = HEX_SPACE,
+  ['\f'] = HEX_SPACE,
+};
+
+// reads ciphertext records of either format, detected from the first byte,
+// through one large buffer that records are parsed from in place
+typedef struct {
+  FILE *infile;
+  off_t base;       // file offset of input byte 0, or -1 if it can't seek
+  uint8_t *buf;     // buffered input
+  size_t cap;       // bytes allocated in buf
+  size_t pos, end;  // the unread input is buf[pos, end)
+  uint64_t offset;  // input offset of buf[0]
+  bool eof;         // true once infile has no more input
+  mpz_srcptr n;     // modulus every record must be below
+  rsa_format_t format;
+  size_t width;     // bytes per binary record
+  uint64_t blocks;  // records promised by the binary header, or BIN_UNKNOWN
+  uint64_t read;    // records read or skipped so far
+  uint64_t limit;   // records to read before stopping
+  rsa_error_t *err; // where to report a rejected record, or NULL
+} ct_reader_t;
+
+// records that the input was rejected at offset for reason; returns false
+static bool ct_fail(ct_reader_t *r, uint64_t offset, const char *reason) {
+  if (r->err != NULL) {
+    r->err->offset = offset;
+    r->err->reason = reason;
+  }
+  return false;
+}
+
+// buffers at least want unread bytes unless the input ends first; returns
+// the number of unread bytes buffered
+static size_t ct_fill(ct_reader_t *r, size_t want) {
+  if (r->end - r->pos >= want || r->eof) {
+    return r->end - r->pos;
+  }
+  if (r->cap - r->pos < want) { // move the unread bytes to the front
+    memmove(r->buf, r->buf + r->pos, r->end - r->pos);
+    r->offset += r->pos;
+    r->end -= r->pos;
+    r->pos = 0;
+    if (r->cap < want) { // a record longer than the buffer
+      r->cap = 2 * want;
+      r->buf = (uint8_t *)realloc(r->buf, r->cap);
+    }
+  }
+  uint64_t start = stats_start();
+  while (r->end - r->pos < want) {
+    size_t got = fread(r->buf + r->end, sizeof(uint8_t), r->cap - r->end,
+                       r->infile);
+    if (got == 0) {
+      r->eof = true;
+      break;
+    }
+    r->end += got;
+  }
+  stats_stop(STAT_IO, start);
+  return r->end - r->pos;
+}
+
+// copies the next len bytes of input to dst; returns the bytes copied,
+// fewer than len only at the end of the input
+static size_t ct_take(ct_reader_t *r, uint8_t *dst, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    size_t avail = ct_fill(r, 1);
+    if (avail == 0) {
+      break;
+    }
+    size_t n = len - done < avail ? len - done : avail;
+    memcpy(dst + done, r->buf + r->pos, n);
+    r->pos += n;
+    done += n;
+  }
+  stats_add(STAT_BYTES_IN, done);
+  return done;
+}
+
+// returns the input offset of the next unread byte
+static uint64_t ct_tell(ct_reader_t *r) { return r->offset + r->pos; }
+
+// moves on to input offset to, which must not be behind ct_tell(r): within
+// the buffer, by seeking if the input can, and otherwise by reading past
+// the bytes in between
+static void ct_seek(ct_reader_t *r, uint64_t to) {
+  uint64_t skip = to - ct_tell(r);
+  if (skip > r->end - r->pos && r->base >= 0 &&
+      fseeko(r->infile, r->base + (off_t)to, SEEK_SET) == 0) {
+    r->offset = to;
+    r->pos = 0;
+    r->end = 0;
+    r->eof = false;
+    return;
+  }
+  while (skip > 0) {
+    size_t avail = ct_fill(r, 1);
+    if (avail == 0) {
+      break;
+    }
+    size_t n = skip < avail ? skip : avail;
+    r->pos += n;
+    skip -= n;
+    stats_add(STAT_BYTES_IN, n);
+  }
+}
+
+// detects the format of infile and checks the binary header against n
+static bool ct_reader_init(ct_reader_t *r, FILE *infile, mpz_t n,
+                           rsa_error_t *err) {
+  r->infile = infile;
+  r->base = ftello(infile);
+  r->cap = CT_BUFFER;
+  r->buf = (uint8_t *)malloc(r->cap);
+  r->pos = 0;
+  r->end = 0;
+  r->offset = 0;
+  r->eof = false;
+  r->n = n;
+  r->format = RSA_FORMAT_HEX;
+  r->width = mpz_sizeinbase(n, 256);
+  r->blocks = BIN_UNKNOWN;
+  r->read = 0;
+  r->limit = UINT64_MAX;
+  r->err = err;
+  if (ct_fill(r, 1) == 0 || r->buf[r->pos] != BIN_MAGIC[0]) {
+    return true; // 'R' is never a hex digit
+  }
+  uint8_t h[BIN_HEADER];
+  if (ct_take(r, h, 4) != 4) {
+    return ct_fail(r, 0, "truncated header");
+  }
+  if (memcmp(h, HYB_MAGIC, 4) == 0) { // hybrid files have a shorter header
+    if (ct_take(r, h + 4, HYB_HEADER - 4) != HYB_HEADER - 4) {
+      return ct_fail(r, 0, "truncated header");
+    }
+    if (get_be(h + 4, 4) != HYB_VERSION || get_be(h + 8, 4) != r->width) {
+      return ct_fail(r, 0, "header of another version or key");
+    }
+    r->format = RSA_FORMAT_HYBRID;
+    return true;
+  }
+  if (ct_take(r, h + 4, BIN_HEADER - 4) != BIN_HEADER - 4) {
+    return ct_fail(r, 0, "truncated header");
+  }
+  if (memcmp(h, BIN_MAGIC, 4) != 0 || get_be(h + 4, 4) != BIN_VERSION ||
+      get_be(h + 8, 4) != r->width) {
+    return ct_fail(r, 0, "header of another version or key");
+  }
+  r->format = RSA_FORMAT_BIN;
+  r->blocks = get_be(h + 16, 8);
+  return true;
+}
+
+// frees the buffer of a reader
+static void ct_reader_free(ct_reader_t *r) {
+  free(r->buf);
+  r->buf = NULL;
+}
+
+// the part of the plaintext being written: the bytes of decrypted records
+// or chunks before the range are dropped and those after it are never
+// written
+typedef struct {
+  FILE *outfile;
+  uint64_t skip; // plaintext bytes still to drop before the range
+  uint64_t left; // plaintext bytes of the range still to write
+} pt_range_t;
+
+// writes the part of len plaintext bytes at p that falls in the range
+static void pt_write(pt_range_t *o, const uint8_t *p, size_t len) {
+  size_t drop = o->skip < len ? o->skip : len;
+  o->skip -= drop;
+  size_t n = o->left < len - drop ? o->left : len - drop;
+  o->left -= n;
+  fwrite(p + drop, sizeof(uint8_t), n, o->outfile);
+  stats_add(STAT_BYTES_OUT, n);
+}
+
+// decrypts the body of a hybrid file: unwraps the session key with one RSA
+// private key operation, then opens the chunks holding the range with
+// ChaCha20-Poly1305. every chunk but the last holds HYB_CHUNK bytes, so the
+// first one needed is found by seeking past the chunks before it
+static bool hybrid_decrypt(ct_reader_t *r, pt_range_t *out, rsa_priv_t *key,
+                           rsa_ctx_t *ctx) {
+  uint8_t *rec = (uint8_t *)malloc(r->width);
+  uint8_t *chunk = (uint8_t *)malloc(HYB_CHUNK + CHACHA_TAG_BYTES);
+  uint8_t skey[CHACHA_KEY_BYTES];
+  bool ok = ct_take(r, rec, r->width) == r->width;
+  if (!ok) {
+    ct_fail(r, HYB_HEADER, "truncated session key");
+  } else { // any z unwraps, a wrong key shows when the first chunk fails
+    mpz_t z;
+    mpz_init(z);
+    mpz_import(z, r->width, 1, 1, 1, 0, rec);
+    rsa_priv_pow(z, z, key, ctx);
+    memset(rec, 0, r->width);
+    size_t bytes = mpz_sizeinbase(z, 256);
+    mpz_export(rec + r->width - bytes, NULL, 1, 1, 1, 0, z);
+    hybrid_kdf(skey, rec, r->width);
+    memset(rec, 0, r->width);
+    mpz_clear(z);
+  }
+  uint64_t first = out->skip / HYB_CHUNK;
+  out->skip %= HYB_CHUNK;
+  if (ok && first > 0) {
+    ct_seek(r, HYB_HEADER + r->width +
+                   first * (4 + HYB_CHUNK + CHACHA_TAG_BYTES));
+  }
+  bool final = false;
+  for (uint64_t i = first; ok && !final && out->left > 0; i++) {
+    uint64_t at = ct_tell(r);
+    uint8_t hdr[4];
+    ok = ct_take(r, hdr, 4) == 4;
+    if (!ok) {
+      ct_fail(r, at, i == first && first > 0
+                         ? "offset past the end of the input"
+                         : "truncated before the final chunk");
+      break;
+    }
+    uint32_t word = (uint32_t)get_be(hdr, 4);
+    final = (word & HYB_FINAL) != 0;
+    size_t len = word & ~HYB_FINAL;
+    ok = len <= HYB_CHUNK &&
+         ct_take(r, chunk, len + CHACHA_TAG_BYTES) == len + CHACHA_TAG_BYTES;
+    if (!ok) {
+      ct_fail(r, at, "truncated chunk");
+      break;
+    }
+    uint8_t nonce[CHACHA_NONCE_BYTES] = { 0 };
+    put_be(nonce + 4, i, 8); // chunk index, so chunks cannot be reordered
+    uint64_t start = stats_start();
+    ok = chacha20_poly1305_open(chunk, len, hdr, sizeof(hdr), skey, nonce,
+                                chunk + len);
+    stats_stop(STAT_MATH, start);
+    if (ok) {
+      start = stats_start();
+      pt_write(out, chunk, len);
+      stats_stop(STAT_IO, start);
+      stats_add(STAT_BLOCKS, 1);
+    } else {
+      ct_fail(r, at, i == 0 ? "chunk fails authentication, or another key "
+                              "wrapped the session key"
+                            : "chunk fails authentication");
+    }
+  }
+  uint8_t extra;
+  if (ok && final && ct_take(r, &extra, 1) != 0) { // as strict as truncation
+    ok = ct_fail(r, ct_tell(r) - 1, "data after the final chunk");
+  }
+  memset(skey, 0, sizeof(skey));
+  free(rec);
+  free(chunk);
+  return ok;
+}
+
+// reads the next record of a binary file into c; returns 1 on success,
+// 0 at the end of the records and -1 if the record is truncated or not
+// below n
+static int ct_read_bin(ct_reader_t *r, mpz_t c) {
+  if (r->read == r->blocks) {
+    return 0;
+  }
+  uint64_t at = ct_tell(r);
+  size_t avail = ct_fill(r, r->width);
+  if (avail == 0 && r->blocks == BIN_UNKNOWN) { // unknown count ends at EOF
+    return 0;
+  }
+  if (avail < r->width) {
+    r->pos += avail;
+    stats_add(STAT_BYTES_IN, avail);
+    ct_fail(r, at, "truncated record");
+    return -1;
+  }
+  uint64_t start = stats_start();
+  mpz_import(c, r->width, 1, 1, 1, 0, r->buf + r->pos);
+  stats_stop(STAT_PARSE, start);
+  r->pos += r->width;
+  stats_add(STAT_BYTES_IN, r->width);
+  if (mpz_cmp(c, r->n) >= 0) {
+    ct_fail(r, at, "record not below n");
+    return -1;
+  }
+  return 1;
+}
+
+// converts the hex digits of s, which may be interleaved with whitespace,
+// straight into the limbs of c; returns 1 on success, 0 if s is blank and
+// -1 if s holds anything else
+static int hex_to_limbs(mpz_t c, const uint8_t *s, size_t len) {
+  mp_size_t cap = (len + GMP_NUMB_BITS / 4 - 1) / (GMP_NUMB_BITS / 4);
+  mp_limb_t *lp = mpz_limbs_write(c, cap > 0 ? cap : 1);
+  mp_size_t nl = 0;
+  mp_limb_t limb = 0;
+  int shift = 0;
+  bool digits = false;
+  for (size_t i = len; i-- > 0;) { // least significant digit first
+    uint8_t v = hex_value[s[i]];
+    if (v == HEX_SPACE) {
+      continue;
+    }
+    if (v == 0) {
+      return -1;
+    }
+    limb |= (mp_limb_t)(v - 1) << shift;
+    digits = true;
+    shift += 4;
+    if (shift == GMP_NUMB_BITS) {
+      lp[nl++] = limb;
+      limb = 0;
+      shift = 0;
+    }
+  }
+  if (shift > 0) {
+    lp[nl++] = limb;
+  }
+  mpz_limbs_finish(c, nl); // strips leading zero limbs
+  return digits ? 1 : 0;
+}
+
+// reads the next non-blank line of a hex file into c; returns 1 on success,
+// 0 at the end of the input and -1 if the line is not a hex value below n
+static int ct_read_hex(ct_reader_t *r, mpz_t c) {
+  while (ct_fill(r, 1) > 0) {
+    size_t scanned = 0;
+    const uint8_t *nl = NULL;
+    size_t avail = r->end - r->pos;
+    while ((nl = memchr(r->buf + r->pos + scanned, '\n', avail - scanned)) ==
+               NULL &&
+           !r->eof) {
+      scanned = avail; // no newline buffered yet, so read on
+      avail = ct_fill(r, avail + 1);
+    }
+    const uint8_t *line = r->buf + r->pos;
+    size_t len = nl != NULL ? (size_t)(nl - line) : avail;
+    size_t next = nl != NULL ? len + 1 : len;
+    uint64_t at = ct_tell(r);
+    r->pos += next;
+    stats_add(STAT_BYTES_IN, next);
+    uint64_t start = stats_start();
+    int got = hex_to_limbs(c, line, len);
+    stats_stop(STAT_PARSE, start);
+    if (got < 0) {
+      ct_fail(r, at, "invalid hex digit");
+      return -1;
+    }
+    if (got > 0 && mpz_cmp(c, r->n) >= 0) {
+      ct_fail(r, at, "record not below n");
+      return -1;
+    }
+    if (got > 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// reads the next record in the format of the input into c; returns 1 on
+// success, 0 at the end of the records or at the limit and -1 if the input
+// is rejected
+static int ct_read(ct_reader_t *r, mpz_t c) {
+  if (r->read == r->limit) {
+    return 0;
+  }
+  int got = r->format == RSA_FORMAT_BIN ? ct_read_bin(r, c)
+                                        : ct_read_hex(r, c);
+  r->read += got > 0;
+  return got;
+}
+
+// moves past the first count records without decrypting them, seeking over
+// fixed width binary records and parsing hex ones; returns false if a
+// skipped record is rejected
+static bool ct_skip(ct_reader_t *r, uint64_t count, mpz_t c) {
+  if (r->format == RSA_FORMAT_BIN) {
+    count = count < r->blocks ? count : r->blocks;
+    ct_seek(r, BIN_HEADER + count * r->width); // past the end reads nothing
+    r->read = count;
+    return true;
+  }
+  while (r->read < count) {
+    int got = ct_read(r, c);
+    if (got <= 0) {
+      return got == 0;
+    }
+  }
+  return true;
+}
+
+#define DEC_BATCH 64 // records per worker thread in each parallel batch
+
+// a batch of ciphertext records and their plaintexts for parallel decryption
+typedef struct {
+  uint8_t *out;    // plaintext of each record, nbytes each
+  size_t *lens;    // number of plaintext bytes in each record
+  mpz_t *c;        // each record, decrypted in place
+  uint64_t count;  // number of records filled
+  bool failed;     // true if reading stopped at a rejected record
+  size_t nbytes;   // bytes needed to hold any value modulo n
+  rsa_priv_t *key; // private key
+  rsa_ctx_t *ctx;  // scratch of each worker
+} dec_batch_t;
+
+// decrypts record i of a dec_batch_t (run on a pool worker)
+static void dec_batch_job(void *arg, uint64_t i, uint32_t worker) {
+  dec_batch_t *b = (dec_batch_t *)arg;
+  uint64_t start = stats_start();
+  rsa_priv_pow(b->c[i], b->c[i], b->key, &b->ctx[worker]);
+  size_t j = 0;
+  uint8_t *block = b->out + i * b->nbytes;
+  mpz_export(block, &j, 1, 1, 1, 0, b->c[i]);
+  b->lens[i] = j > 0 ? j - 1 : 0; // drop the 0xFF prefix byte
+  stats_stop(STAT_MATH, start);
+}
+
+// fills a batch with up to max records parsed from the input
+static void dec_batch_read(dec_batch_t *b, uint64_t max, ct_reader_t *r) {
+  b->count = 0;
+  b->failed = false;
+  while (b->count < max) {
+    int got = ct_read(r, b->c[b->count]);
+    b->failed = got < 0;
+    if (got <= 0) {
+      break;
+    }
+    b->count++;
+  }
+}
+
+// decrypts infile with a pool of worker threads. the reader fills one batch
+// of records while the workers decrypt the other, and plaintext is written
+// batch by batch in input order, so memory stays bounded by two batches.
+// ok is set to false if a record is rejected
+static bool rsa_decrypt_file_mt(ct_reader_t *r, pt_range_t *out,
+                                rsa_priv_t *key, uint32_t threads, bool *ok) {
+  pool_t *pool = pool_create(threads);
+  if (pool == NULL) {
+    return false;
+  }
+  uint64_t max = (uint64_t)threads * DEC_BATCH;
+  rsa_ctx_t *ctx = (rsa_ctx_t *)malloc(threads * sizeof(rsa_ctx_t));
+  for (uint32_t i = 0; i < threads; i++) {
+    rsa_ctx_init(&ctx[i], key);
+  }
+  dec_batch_t batches[2];
+  for (int b = 0; b < 2; b++) {
+    batches[b].nbytes = r->width;
+    batches[b].out = (uint8_t *)malloc(max * batches[b].nbytes);
+    batches[b].lens = (size_t *)malloc(max * sizeof(size_t));
+    batches[b].c = (mpz_t *)malloc(max * sizeof(mpz_t));
+    batches[b].key = key;
+    batches[b].ctx = ctx;
+    for (uint64_t i = 0; i < max; i++) {
+      mpz_init2(batches[b].c[i], 8 * r->width);
+    }
+  }
+
+  *ok = true;
+  dec_batch_t *cur = &batches[0];
+  dec_batch_t *next = &batches[1];
+  dec_batch_read(cur, max, r);
+  if (cur->count > 0) {
+    pool_start(pool, dec_batch_job, cur, cur->count);
+  }
+  while (cur->count > 0) {
+    if (!cur->failed) {
+      dec_batch_read(next, max, r); // read ahead while cur is decrypted
+    } else {
+      next->count = 0;
+      next->failed = false;
+    }
+    pool_wait(pool);
+    if (next->count > 0) {
+      pool_start(pool, dec_batch_job, next, next->count);
+    }
+    uint64_t start = stats_start();
+    for (uint64_t i = 0; i < cur->count; i++) { // in input order
+      pt_write(out, cur->out + i * cur->nbytes + 1, cur->lens[i]);
+      stats_add(STAT_BLOCKS, 1);
+    }
+    stats_stop(STAT_IO, start);
+    if (cur->failed) {
+      break;
+    }
+    dec_batch_t *t = cur;
+    cur = next;
+    next = t;
+  }
+  *ok = !cur->failed;
+
+  pool_delete(&pool);
+  for (int b = 0; b < 2; b++) {
+    for (uint64_t i = 0; i < max; i++) {
+      mpz_clear(batches[b].c[i]);
+    }
+    free(batches[b].out);
+    free(batches[b].lens);
+    free(batches[b].c);
+  }
+  for (uint32_t i = 0; i < threads; i++) {
+    rsa_ctx_clear(&ctx[i]);
+  }
+  free(ctx);
+  return true;
+}
+
+// decrypts the length plaintext bytes from offset on of infile with scratch
+// ctx, writing them to outfile. every record but the last holds k - 1
+// bytes, so only the records covering the range are decrypted
+static bool decrypt_range(FILE *infile, FILE *outfile, rsa_priv_t *key,
+                          rsa_ctx_t *ctx, uint32_t threads, uint64_t offset,
+                          uint64_t length, rsa_error_t *err) {
+  ct_reader_t r;
+  bool ok = ct_reader_init(&r, infile, key->n, err);
+  if (!ok) {
+    ct_reader_free(&r);
+    return false;
+  }
+  pt_range_t out = { outfile, offset, length }; // skip cut to one block below
+  if (r.format == RSA_FORMAT_HYBRID) {
+    ok = hybrid_decrypt(&r, &out, key, ctx);
+    ct_reader_free(&r);
+    return ok;
+  }
+  uint64_t k = (mpz_sizeinbase(key->n, 2) - 1) / 8;
+  uint64_t per = k > 1 ? k - 1 : 1; // plaintext bytes in a full record
+  uint64_t first = offset / per;
+  out.skip = offset % per;
+  uint64_t span = length > UINT64_MAX - out.skip ? UINT64_MAX
+                                                 : out.skip + length;
+  uint64_t count = span / per + (span % per != 0); // records in the range
+  r.limit = count > UINT64_MAX - first ? UINT64_MAX : first + count;
+  mpz_t c, m;
+  mpz_init2(c, 8 * r.width);
+  mpz_init2(m, 8 * r.width);
+  ok = ct_skip(&r, first, c);
+  if (!ok || (threads > 1 &&
+              rsa_decrypt_file_mt(&r, &out, key, threads, &ok))) {
+    ct_reader_free(&r);
+    mpz_clears(c, m, NULL);
+    return ok;
+  }
+  size_t nbytes = r.width; // bytes in the largest message
+  uint8_t *block = (uint8_t *)calloc(
+      nbytes, sizeof(uint8_t)); // one block reused for all records
   size_t j = 0; // used later for bytes converted from message
   while (1) {   // while not at end of file
-    uint8_t *block = (uint8_t *)calloc(
-        k, sizeof(uint8_t)); // dynamically allocate array of k bytes
-    if (feof(infile)) {      // if end of file is reached / all bytes processed
-      free(block);
-      block = NULL; // clear block
-      break;        // exit out of while loop
-    }
-    gmp_fscanf(infile, "%Zx\n",
-               c);           // scan in a hexstring, saving it to c (ciphertext)
-    rsa_decrypt(m, c, d, n); // decrypt ciphertext c and store in message m
+    int got = ct_read(&r, c); // parse one record into c
+    if (got <= 0) {
+      ok = got == 0;
+      break;
+    }
+    uint64_t start = stats_start();
+    rsa_priv_pow(m, c, key, ctx); // decrypt ciphertext c into message m
     mpz_export(block, &j, 1, 1, 1, 0,
                m); // convert message into bytes, stored them into block
-    fwrite(block + 1, sizeof(uint8_t), j - 1,
-           outfile); // write out j - 1 bytes starting from index 1 of block to
-                     // outfile
-    free(block);
-    block = NULL; // clear block
+    stats_stop(STAT_MATH, start);
+    start = stats_start();
+    if (j > 0) { // write the part in the range of the j - 1 bytes after 0xFF
+      pt_write(&out, block + 1, j - 1);
+    }
+    stats_add(STAT_BLOCKS, 1);
+    stats_stop(STAT_IO, start);
   }
+  free(block);
+  ct_reader_free(&r);
   mpz_clears(c, m, NULL); // clear used mpz vars
+  return ok;
+}
+
+// decrypts the content of infile, writing the decrypted contents to outfile
+bool rsa_decrypt_file(FILE *infile, FILE *outfile, rsa_priv_t *key,
+                      uint32_t threads, rsa_error_t *err) {
+  return rsa_decrypt_range(infile, outfile, key, threads, 0, UINT64_MAX, err);
 }
 
-// performs rsa signing, producing signature s by signing msg m using priv key d
-// and pub modulus n
-void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n) { pow_mod(s, m, d, n); }
+// decrypts the content of infile on this thread with scratch prepared for key
+bool rsa_decrypt_file_ctx(FILE *infile, FILE *outfile, rsa_priv_t *key,
+                          rsa_ctx_t *ctx, rsa_error_t *err) {
+  return decrypt_range(infile, outfile, key, ctx, 1, 0, UINT64_MAX, err);
+}
+
+// decrypts the length plaintext bytes from offset on of infile, writing them
+// to outfile
+bool rsa_decrypt_range(FILE *infile, FILE *outfile, rsa_priv_t *key,
+                       uint32_t threads, uint64_t offset, uint64_t length,
+                       rsa_error_t *err) {
+  rsa_ctx_t ctx; // used by the hybrid and single threaded paths
+  rsa_ctx_init(&ctx, key);
+  bool ok = decrypt_range(infile, outfile, key, &ctx, threads, offset, length,
+                          err);
+  rsa_ctx_clear(&ctx);
+  return ok;
+}
+
+// performs rsa signing, producing signature s by signing msg m using priv key
+void rsa_sign(mpz_t s, mpz_t m, rsa_priv_t *key) {
+  rsa_ctx_t ctx;
+  rsa_ctx_init(&ctx, key);
+  rsa_sign_ctx(s, m, key, &ctx);
+  rsa_ctx_clear(&ctx);
+}
+
+// signs msg m with scratch prepared for key
+void rsa_sign_ctx(mpz_t s, mpz_t m, rsa_priv_t *key, rsa_ctx_t *ctx) {
+  rsa_priv_pow(s, m, key, ctx);
+}
 
 // performs rsa verification, returning true if signature s is verified and
 // false otherwise
@@ -5,6 +5,8 @@
 #include <gmp.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include "numtheory.h"
+#include "randstate.h"
 // clang-format on
 
 //
@@ -12,16 +14,88 @@
 // p and q will be large primes with n their product.
 // The product n will be of a specified minimum number of bits.
 // The primality is tested using Miller-Rabin.
-// The public exponent e will have around the same number of bits as n.
+// If pubexp is nonzero it is used as the public exponent e, and the primes
+// are regenerated until e is coprime with lambda(n). Otherwise e is drawn at
+// random and will have around the same number of bits as n.
 // All mpz_t arguments are expected to be initialized.
 //
 // p: will store the first large prime.
 // q: will store the second large prime.
 // n: will store the product of p and q.
 // e: will store the public exponent.
+// nbits: the minimum number of bits in n.
+// iters: the number of Miller-Rabin iterations.
+// pubexp: the fixed odd public exponent to use, or 0 for a random one.
+// threads: the number of threads searching for each prime. With more than
+//          one, every worker draws from its own stream split from rs, so a
+//          seed and thread count always give the same key.
+// rs: the random state to draw from, used by this call only.
 //
 void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits,
-                  uint64_t iters);
+                  uint64_t iters, uint64_t pubexp, uint32_t threads,
+                  randstate_t *rs);
+
+#define RSA_MAX_PRIMES 4 // most primes in the modulus of a multi-prime key
+
+//
+// Generates the components for a new public RSA key whose modulus is the
+// product of nprimes distinct primes. With two primes this behaves like
+// rsa_make_pub(); with more, the primes are of balanced sizes, so each is
+// about nbits / nprimes bits long. Primes are taken from a prime pool first
+// when one is given, and are then balanced for two primes too.
+// All mpz_t arguments are expected to be initialized.
+//
+// primes: will store the nprimes primes.
+// nprimes: the number of primes, from 2 to RSA_MAX_PRIMES.
+// n: will store the product of the primes.
+// e: will store the public exponent.
+// nbits: the minimum number of bits in n.
+// iters: the number of Miller-Rabin iterations.
+// pubexp: the fixed odd public exponent to use, or 0 for a random one.
+// threads: the number of threads searching for each prime.
+// primepool: the path of a prime pool to draw from, or NULL. Each prime
+//            taken is removed from the pool; when the pool has none of the
+//            right size, the prime is generated instead.
+// rs: the random state to draw from, used by this call only.
+//
+void rsa_make_pub_multi(mpz_t primes[], uint32_t nprimes, mpz_t n, mpz_t e,
+                        uint64_t nbits, uint64_t iters, uint64_t pubexp,
+                        uint32_t threads, const char *primepool,
+                        randstate_t *rs);
+
+//
+// Generates the components of a multi-prime RSA public key like
+// rsa_make_pub_multi() with a prime pool, but with the first primes already
+// taken from the pool by the caller, so that keys made at once can be given
+// their pool primes in a fixed order. The primes have the balanced sizes of
+// rsa_prime_sizes(), and those given must have them too.
+// All mpz_t arguments are expected to be initialized.
+//
+// primes: holds the given primes, and will store all nprimes primes.
+// given: the number of leading primes set by the caller, at most nprimes.
+// nprimes: the number of primes, from 2 to RSA_MAX_PRIMES.
+// n: will store the product of the primes.
+// e: will store the public exponent.
+// nbits: the minimum number of bits in n.
+// iters: the number of Miller-Rabin iterations.
+// pubexp: the fixed odd public exponent to use, or 0 for a random one. The
+//         given primes p must have p - 1 coprime to it.
+// threads: the number of threads searching for each prime.
+// rs: the random state to draw from, used by this call only.
+//
+void rsa_make_pub_given(mpz_t primes[], uint32_t given, uint32_t nprimes,
+                        mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+                        uint64_t pubexp, uint32_t threads, randstate_t *rs);
+
+//
+// Computes the sizes of the balanced primes of a multi-prime modulus, which
+// are the sizes that rsa_make_pub_multi() takes from a prime pool.
+//
+// sizes: will store the size in bits of each of the nprimes primes.
+// nbits: the minimum number of bits in the modulus.
+// nprimes: the number of primes, from 2 to RSA_MAX_PRIMES.
+//
+void rsa_prime_sizes(uint64_t sizes[], uint64_t nbits, uint32_t nprimes);
 
 //
 // Writes a public RSA key to a file.
@@ -45,8 +119,94 @@ void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 // s: will store the signature.
 // username: an allocated array to hold the username.
 // pbfile: the file containing the public key
+// returns: true if all four fields were read, false otherwise.
 //
-void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
+bool rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
+
+//
+// An RSA private key.
+// Keys written by current versions carry the CRT components so that
+// decryption and signing can work modulo p and q separately.
+// Keys read from a legacy file only hold n and d, in which case crt is false.
+// Multi-prime keys carry one more prime r_i per extra factor of n, with its
+// exponent and the coefficient that Garner's recombination needs for it.
+//
+// n: the public modulus.
+// d: the private exponent.
+// p: the first large prime.
+// q: the second large prime.
+// dp: d mod (p - 1).
+// dq: d mod (q - 1).
+// qinv: the inverse of q modulo p.
+// r: the primes after p and q, r_3 to r_nprimes.
+// dr: d mod (r_i - 1).
+// rinv: the inverse of p q r_3 ... r_(i-1) modulo r_i.
+// nprimes: the number of primes in n, if crt is true.
+// crt: true if p, q, dp, dq, qinv and the first nprimes - 2 entries of r,
+//      dr and rinv are valid.
+//
+typedef struct {
+  mpz_t n, d;
+  mpz_t p, q;
+  mpz_t dp, dq, qinv;
+  mpz_t r[RSA_MAX_PRIMES - 2];
+  mpz_t dr[RSA_MAX_PRIMES - 2];
+  mpz_t rinv[RSA_MAX_PRIMES - 2];
+  uint32_t nprimes;
+  bool crt;
+} rsa_priv_t;
+
+//
+// Initializes all components of an RSA private key.
+// Must be called before the key is used and paired with rsa_priv_clear().
+//
+// key: the private key to initialize.
+//
+void rsa_priv_init(rsa_priv_t *key);
+
+//
+// Frees any memory used by an RSA private key.
+//
+// key: the private key to clear.
+//
+void rsa_priv_clear(rsa_priv_t *key);
+
+//
+// Scratch for the private key operations of one thread, holding the
+// montgomery constants and exponent plans of one key, so a caller making
+// many operations with that key prepares them once instead of per call.
+//
+// nt: the numtheory context prepared for the moduli of the key.
+// m1, m2, h: CRT temporaries.
+// mr: the residues modulo the extra primes.
+// prod: the product of the primes recombined so far.
+// xd, xp, xq: the plans of d, dp and dq.
+// xr: the plans of the extra exponents.
+//
+typedef struct {
+  nt_ctx_t nt;
+  mpz_t m1, m2, h;
+  mpz_t mr[RSA_MAX_PRIMES - 2];
+  mpz_t prod;
+  nt_exp_t xd, xp, xq;
+  nt_exp_t xr[RSA_MAX_PRIMES - 2];
+} rsa_ctx_t;
+
+//
+// Initializes scratch for private key operations with a key.
+// Must be paired with rsa_ctx_clear(); the key must outlive the scratch.
+//
+// ctx: the scratch to initialize.
+// key: the private key it is prepared for.
+//
+void rsa_ctx_init(rsa_ctx_t *ctx, rsa_priv_t *key);
+
+//
+// Frees the memory used by scratch for private key operations.
+//
+// ctx: the scratch to clear.
+//
+void rsa_ctx_clear(rsa_ctx_t *ctx);
 
 //
 // Generates the components for a new private RSA key.
@@ -61,24 +221,64 @@ void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q);
 
 //
-// Writes a private RSA key to a file.
-// Private key contents: n, d.
+// Generates the private exponent of a multi-prime RSA key.
+// All mpz_t arguments are expected to be initialized.
+//
+// d: will store the RSA private key.
+// e: the precomputed public exponent.
+// primes: the primes from rsa_make_pub_multi().
+// nprimes: the number of primes.
+//
+void rsa_make_priv_multi(mpz_t d, mpz_t e, mpz_t primes[], uint32_t nprimes);
+
+//
+// Fills in a private key from its modulus, exponent and primes,
+// precomputing the CRT components dp, dq and qinv.
 // All mpz_t arguments are expected to be initialized.
 //
+// key: the initialized private key to fill in.
 // n: the public modulus.
-// d: the private key.
+// d: the private exponent.
+// p: the first large prime.
+// q: the second large prime.
+//
+void rsa_priv_set(rsa_priv_t *key, mpz_t n, mpz_t d, mpz_t p, mpz_t q);
+
+//
+// Fills in a private key from its modulus, exponent and any number of
+// primes, precomputing the CRT components of every prime.
+// All mpz_t arguments are expected to be initialized.
+//
+// key: the initialized private key to fill in.
+// n: the public modulus.
+// d: the private exponent.
+// primes: the primes whose product is n, p and q first.
+// nprimes: the number of primes, from 2 to RSA_MAX_PRIMES.
+//
+void rsa_priv_set_multi(rsa_priv_t *key, mpz_t n, mpz_t d, mpz_t primes[],
+                        uint32_t nprimes);
+
+//
+// Writes a private RSA key to a file.
+// Private key contents: version header, n, d, p, q, dp, dq, qinv.
+// Multi-prime keys use version 3, whose header also holds the number of
+// primes, and follow qinv with r_i, dr_i and rinv_i for every extra prime.
+//
+// key: the private key to write.
 // pvfile: the file to write the private key to.
 //
-void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile);
+void rsa_write_priv(rsa_priv_t *key, FILE *pvfile);
 
 //
 // Reads a private RSA key from a file.
-// Private key contents: n, d.
-// All mpz_t arguments are expected to be initialized.
+// Accepts the versioned two-prime and multi-prime CRT formats and the
+// legacy format that only contains n and d.
 //
-// n: will store the public modulus.
-// d: will store the private key.
-void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile);
+// key: an initialized private key to store the contents in.
+// pvfile: the file containing the private key.
+// returns: true if the key was read, false if the file is malformed.
+//
+bool rsa_read_priv(rsa_priv_t *key, FILE *pvfile);
 
 //
 // Encrypts a message given an RSA public exponent and modulus.
@@ -91,8 +291,44 @@ void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile);
 //
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n);
 
+//
+// Output formats for encrypted files.
+//
+// RSA_FORMAT_HEX: one lowercase hex ciphertext per line.
+// RSA_FORMAT_BIN: a 32 byte header followed by fixed width records.
+//   The header holds, all big-endian: the magic "RSAB", a 4 byte version,
+//   the 4 byte record width ceil(bits(n) / 8), 4 reserved bytes, the 8 byte
+//   record count and the 8 byte plaintext length. Both totals are all ones
+//   if the output could not be rewound to fill them in. Record i is the
+//   zero padded ciphertext at offset 32 + i * width.
+// RSA_FORMAT_HYBRID: RSA-KEM and ChaCha20-Poly1305. A random z below n is
+//   wrapped with rsa_encrypt, and the payload is sealed under the session
+//   key SHA-256(z || 00000001), z taken as width big-endian bytes. After a
+//   16 byte header ("RSAH", version, record width, reserved) comes the
+//   wrapped z as one record, then chunks of a 4 byte length (top bit set on
+//   the last chunk), up to 64 KiB of ciphertext and a 16 byte tag. Chunk i
+//   uses the nonce 0^4 || i and authenticates its length word. Nothing may
+//   follow the last chunk.
+//
+typedef enum {
+  RSA_FORMAT_HEX,
+  RSA_FORMAT_BIN,
+  RSA_FORMAT_HYBRID
+} rsa_format_t;
+
+//
+// Where and why rsa_decrypt_file() rejected its input, or why
+// rsa_encrypt_file() could not encrypt.
+//
+typedef struct {
+  uint64_t offset;    // input offset of the rejected header, record or chunk
+  const char *reason; // what is wrong with it
+} rsa_error_t;
+
 //
 // Encrypts an entire file given an RSA public modulus and exponent.
+// With more than one thread, blocks are encrypted on a pool of worker
+// threads; the output is identical to the single threaded output.
 // All mpz_t arguments are expected to be initialized.
 // All FILE * arguments are expected to be properly opened.
 //
@@ -100,42 +336,106 @@ void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n);
 // outfile: the output file to write the encrypted input to.
 // n: the public modulus.
 // e: the public exponent.
-//
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
+// threads: the number of worker threads to encrypt with (unused by hybrid).
+// format: the format of the encrypted output.
+// err: if not NULL, will store why nothing was encrypted, at offset 0.
+// returns: false, before writing anything, if the modulus is too small for
+//          hybrid mode or no random bytes could be read, true otherwise.
+//
+bool rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e,
+                      uint32_t threads, rsa_format_t format,
+                      rsa_error_t *err);
 
 //
-// Decrypts some ciphertext given an RSA private key and public modulus.
+// Decrypts some ciphertext given an RSA private key.
+// Uses CRT recombination when the key carries its CRT components.
 // All mpz_t arguments are expected to be initialized.
 //
 // m: will store the decrypted message.
 // c: the ciphertext to decrypt.
-// d: the private key.
-// n: the public modulus.
+// key: the private key.
 //
-void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n);
+void rsa_decrypt(mpz_t m, mpz_t c, rsa_priv_t *key);
 
 //
-// Decrypts an entire file given an RSA public modulus and private key.
-// All mpz_t arguments are expected to be initialized.
+// Decrypts an entire file given an RSA private key.
+// The format of the input (hex, binary or hybrid) is detected automatically.
+// With more than one thread, records are decrypted on a pool of worker
+// threads in bounded batches and the plaintext is written in input order.
 // All FILE * arguments are expected to be properly opened.
 //
 // infile: the input file to decrypt.
 // outfile: the output file to write the decrypted input to.
-// n: the public modulus.
-// d: the private key.
+// key: the private key.
+// threads: the number of worker threads to decrypt with.
+// err: if not NULL, will store where and why the input was rejected.
+// returns: false if the input is malformed, truncated or fails
+//          authentication, true otherwise.
+//
+bool rsa_decrypt_file(FILE *infile, FILE *outfile, rsa_priv_t *key,
+                      uint32_t threads, rsa_error_t *err);
+
+//
+// Decrypts an entire file on the calling thread like rsa_decrypt_file(),
+// using scratch prepared once for the key instead of preparing it per call.
+// All FILE * arguments are expected to be properly opened.
 //
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
+// infile: the input file to decrypt.
+// outfile: the output file to write the decrypted input to.
+// key: the private key.
+// ctx: scratch initialized for key and used by no other thread meanwhile.
+// err: if not NULL, will store where and why the input was rejected.
+// returns: false if the input is malformed, truncated or fails
+//          authentication, true otherwise.
+//
+bool rsa_decrypt_file_ctx(FILE *infile, FILE *outfile, rsa_priv_t *key,
+                          rsa_ctx_t *ctx, rsa_error_t *err);
 
 //
-// Signs some message given an RSA private key and public modulus.
+// Decrypts one byte range of the plaintext of a file given an RSA private
+// key, like rsa_decrypt_file() but decrypting only the records or hybrid
+// chunks that cover the range. Their fixed sizes locate the first one, which
+// is reached by seeking when infile can seek; hex records before it are
+// parsed but not decrypted. A range running past the end of the plaintext
+// is cut short.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to decrypt.
+// outfile: the output file to write the decrypted range to.
+// key: the private key.
+// threads: the number of worker threads to decrypt with.
+// offset: the plaintext offset of the first byte to write.
+// length: the number of plaintext bytes to write at most.
+// err: if not NULL, will store where and why the input was rejected.
+// returns: false if the input is malformed, truncated or fails
+//          authentication, true otherwise.
+//
+bool rsa_decrypt_range(FILE *infile, FILE *outfile, rsa_priv_t *key,
+                       uint32_t threads, uint64_t offset, uint64_t length,
+                       rsa_error_t *err);
+
+//
+// Signs some message given an RSA private key.
+// Uses CRT recombination when the key carries its CRT components.
 // All mpz_t arguments are expected to be initialized.
 //
 // s: will store the signed message (the signature).
 // m: the message to sign.
-// d: the private key.
-// n: the public modulus.
+// key: the private key.
+//
+void rsa_sign(mpz_t s, mpz_t m, rsa_priv_t *key);
+
+//
+// Signs some message like rsa_sign(), using scratch prepared once for the
+// key instead of preparing it per call.
+// All mpz_t arguments are expected to be initialized.
+//
+// s: will store the signed message (the signature).
+// m: the message to sign.
+// key: the private key.
+// ctx: scratch initialized for key and used by no other thread meanwhile.
 //
-void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n);
+void rsa_sign_ctx(mpz_t s, mpz_t m, rsa_priv_t *key, rsa_ctx_t *ctx);
 
 //
 // Verifies some signature given an RSA public exponent and modulus.
@@ -0,0 +1,632 @@
+// clang-format off
+#include <stdio.h>
+#include <gmp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "keycache.h"
+#include "pool.h"
+#include "rsa.h"
+#include "service.h"
+#include "stats.h"
+// clang-format on
+
+#define OPTIONS "s:n:t:h"
+#define OPT_STATS 256 // --stats has no short form
+
+#define MAX_KEYS     16  // keys a server can hold, numbered from 0
+#define MAX_CLIENTS  256 // connections served at once
+#define HIST_BUCKETS 32  // latency buckets: bucket i counts < 2^i us
+
+static const struct option long_options[] = {
+  { "stats", optional_argument, NULL, OPT_STATS },
+  { NULL, 0, NULL, 0 },
+};
+
+// a private key served by the daemon, parsed or mapped from a compiled file
+typedef struct {
+  rsa_priv_t parsed;
+  keycache_t kc;
+  rsa_priv_t *key; // &parsed or &kc.key
+  rsa_ctx_t *ctx;  // scratch of each worker, prepared once for key
+  uint32_t nctx;
+} server_key_t;
+
+// one connection and the request it is working on
+typedef struct {
+  int fd;
+  uint8_t hdr[SVC_HEADER];
+  uint8_t *payload;
+  size_t got;          // bytes of header and payload received
+  bool ready;          // a complete request waits for the next batch
+  bool closing;        // close once the reply is sent
+  uint64_t start;      // time the request was complete, in nanoseconds
+  svc_status_t status; // outcome of the request, set by the batch
+  uint8_t *result;     // reply payload, set by the batch
+  size_t rlen;
+  uint8_t *out; // reply being sent: header and payload
+  size_t outlen;
+  size_t sent;
+} client_t;
+
+// counters of the requests served, exposed by SVC_STATS
+typedef struct {
+  uint64_t requests[SVC_STATS + 1]; // by operation
+  uint64_t errors;                  // replies other than SVC_OK
+  uint64_t batches;                 // batches run on the workers
+  uint64_t max_batch;               // requests in the largest batch
+  uint64_t done;                    // replies sent for decrypt and sign
+  uint64_t total_ns;                // their summed latency
+  uint64_t max_ns;
+  uint64_t hist[HIST_BUCKETS];
+} latency_t;
+
+// the daemon state shared by the batch jobs
+typedef struct {
+  server_key_t keys[MAX_KEYS];
+  uint32_t nkeys;
+  client_t **batch; // clients whose requests are in the current batch
+} server_t;
+
+static volatile sig_atomic_t stopping = 0; // set by SIGINT and SIGTERM
+static int wake[2] = { -1, -1 }; // self-pipe the signal handler wakes poll by
+
+// prints the program synopsis and usage
+static void usage(void) {
+  fprintf(stderr, "Usage: ./rsad [options]\n");
+  fprintf(stderr, "  ./rsad loads private keys once and serves decrypt and "
+                  "sign requests\n");
+  fprintf(stderr, "  on a Unix domain socket until interrupted.\n");
+  fprintf(stderr, "    -s <socket> : Listen on <socket>. Default: "
+                  "rsad.sock\n");
+  fprintf(stderr, "    -n <keyfile>: Serve the private key in <keyfile>; "
+                  "repeat for more keys,\n");
+  fprintf(stderr, "                  numbered from 0. Default: rsa.priv\n");
+  fprintf(stderr, "    -t <threads>: Run batches of requests on <threads> "
+                  "threads. Default: online CPUs\n");
+  fprintf(stderr, "    --stats[=json]: Print counters and timings to "
+                  "stderr when stopped.\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
+
+// returns the monotonic clock in nanoseconds
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// asks the main loop to stop. the byte left in the pipe wakes a poll that
+// starts after the loop checked stopping, so the signal can't be missed
+static void on_signal(int sig) {
+  (void)sig;
+  int saved = errno;
+  stopping = 1;
+  ssize_t n = write(wake[1], "", 1); // a full pipe is already awake
+  (void)n;
+  errno = saved;
+}
+
+// creates the non-blocking self-pipe that on_signal writes to
+static bool wake_open(void) {
+  if (pipe(wake) != 0) {
+    return false;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(wake[i], F_SETFL, fcntl(wake[i], F_GETFL) | O_NONBLOCK);
+    fcntl(wake[i], F_SETFD, FD_CLOEXEC);
+  }
+  return true;
+}
+
+// loads the private key in path, parsed or mapped if it is compiled
+static bool load_key(server_key_t *k, const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return false;
+  }
+  rsa_priv_init(&k->parsed);
+  k->kc.base = NULL;
+  k->ctx = NULL;
+  k->nctx = 0;
+  bool ok;
+  if (keycache_probe(f)) {
+    ok = keycache_map(&k->kc, f) && k->kc.priv;
+    k->key = &k->kc.key;
+  } else {
+    ok = rsa_read_priv(&k->parsed, f);
+    k->key = &k->parsed;
+  }
+  fclose(f); // a mapping outlives the file it came from
+  return ok;
+}
+
+// prepares the scratch each of workers threads uses with a loaded key
+static void key_contexts(server_key_t *k, uint32_t workers) {
+  k->ctx = (rsa_ctx_t *)malloc(workers * sizeof(rsa_ctx_t));
+  for (uint32_t i = 0; i < workers; i++) {
+    rsa_ctx_init(&k->ctx[i], k->key);
+  }
+  k->nctx = workers;
+}
+
+// frees a loaded key
+static void free_key(server_key_t *k) {
+  for (uint32_t i = 0; i < k->nctx; i++) {
+    rsa_ctx_clear(&k->ctx[i]);
+  }
+  free(k->ctx);
+  rsa_priv_clear(&k->parsed);
+  keycache_unmap(&k->kc);
+}
+
+// decrypts a ciphertext file held in memory
+static svc_status_t do_decrypt(client_t *c, rsa_priv_t *key, rsa_ctx_t *ctx,
+                               uint32_t len) {
+  if (len == 0) { // an empty file decrypts to nothing
+    return SVC_OK;
+  }
+  FILE *in = fmemopen(c->payload, len, "r");
+  char *buf = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&buf, &size);
+  bool ok = in != NULL && out != NULL &&
+            rsa_decrypt_file_ctx(in, out, key, ctx, NULL);
+  if (in != NULL) {
+    fclose(in);
+  }
+  if (out != NULL) {
+    fclose(out); // sets buf and size
+  }
+  c->result = (uint8_t *)buf;
+  c->rlen = size;
+  return ok ? SVC_OK : SVC_FAILED;
+}
+
+// signs a big-endian message smaller than n
+static svc_status_t do_sign(client_t *c, rsa_priv_t *key, rsa_ctx_t *ctx,
+                            uint32_t len) {
+  mpz_t m;
+  mpz_init(m);
+  mpz_import(m, len, 1, 1, 1, 0, c->payload);
+  svc_status_t status = SVC_FAILED;
+  if (mpz_cmp(m, key->n) < 0) {
+    rsa_sign_ctx(m, m, key, ctx);
+    c->result = (uint8_t *)malloc(mpz_sizeinbase(m, 256));
+    mpz_export(c->result, &c->rlen, 1, 1, 1, 0, m);
+    status = SVC_OK;
+  }
+  mpz_clear(m);
+  return status;
+}
+
+// serves request i of the current batch (run on a pool worker)
+static void batch_job(void *arg, uint64_t i, uint32_t worker) {
+  server_t *s = (server_t *)arg;
+  client_t *c = s->batch[i];
+  uint32_t len = svc_length(c->hdr);
+  server_key_t *k = c->hdr[1] < s->nkeys ? &s->keys[c->hdr[1]] : NULL;
+  c->result = NULL;
+  c->rlen = 0;
+  if (c->hdr[0] != SVC_DECRYPT && c->hdr[0] != SVC_SIGN) {
+    c->status = SVC_BAD_OP;
+  } else if (k == NULL) {
+    c->status = SVC_BAD_KEY;
+  } else if (c->hdr[0] == SVC_DECRYPT) {
+    c->status = do_decrypt(c, k->key, &k->ctx[worker], len);
+  } else {
+    c->status = do_sign(c, k->key, &k->ctx[worker], len);
+  }
+}
+
+// queues the reply of a finished request on its client
+static void client_reply(client_t *c, latency_t *lat) {
+  if (c->status != SVC_OK) {
+    free(c->result);
+    c->result = NULL;
+    c->rlen = 0;
+    lat->errors++;
+  }
+  c->out = (uint8_t *)malloc(SVC_HEADER + c->rlen);
+  svc_header(c->out, c->status, 0, (uint32_t)c->rlen);
+  if (c->rlen > 0) {
+    memcpy(c->out + SVC_HEADER, c->result, c->rlen);
+  }
+  free(c->result);
+  c->result = NULL;
+  c->outlen = SVC_HEADER + c->rlen;
+  c->sent = 0;
+  c->ready = false;
+  free(c->payload);
+  c->payload = NULL;
+}
+
+// returns the upper bound in microseconds of the bucket holding quantile q
+static uint64_t hist_quantile(latency_t *lat, double q) {
+  uint64_t want = (uint64_t)(q * lat->done + 0.999999), seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += lat->hist[i];
+    if (seen >= want && seen > 0) {
+      return (uint64_t)1 << i;
+    }
+  }
+  return 0;
+}
+
+// builds the JSON reply of a stats request
+static void stats_reply(client_t *c, latency_t *lat) {
+  char *buf = NULL;
+  size_t size = 0;
+  FILE *f = open_memstream(&buf, &size);
+  uint64_t total = 0;
+  for (int i = 0; i <= SVC_STATS; i++) {
+    total += lat->requests[i];
+  }
+  fprintf(f,
+          "{\"requests\": %" PRIu64 ", \"decrypt\": %" PRIu64
+          ", \"sign\": %" PRIu64 ", \"stats\": %" PRIu64
+          ", \"errors\": %" PRIu64 ", \"batches\": %" PRIu64
+          ", \"max_batch\": %" PRIu64,
+          total, lat->requests[SVC_DECRYPT], lat->requests[SVC_SIGN],
+          lat->requests[SVC_STATS], lat->errors, lat->batches,
+          lat->max_batch);
+  fprintf(f,
+          ", \"mean_us\": %.1f, \"max_us\": %.1f, \"p50_us\": %" PRIu64
+          ", \"p99_us\": %" PRIu64 "}\n",
+          lat->done > 0 ? lat->total_ns / 1e3 / lat->done : 0.0,
+          lat->max_ns / 1e3, hist_quantile(lat, 0.50),
+          hist_quantile(lat, 0.99));
+  fclose(f);
+  c->status = SVC_OK;
+  c->result = (uint8_t *)buf;
+  c->rlen = size;
+  client_reply(c, lat);
+}
+
+// records the latency of a request whose reply was fully sent
+static void latency_add(latency_t *lat, uint64_t ns) {
+  lat->done++;
+  lat->total_ns += ns;
+  if (ns > lat->max_ns) {
+    lat->max_ns = ns;
+  }
+  int b = 0;
+  while (b < HIST_BUCKETS - 1 && ((uint64_t)1 << b) * 1000 <= ns) {
+    b++;
+  }
+  lat->hist[b]++;
+}
+
+// closes a connection and frees its buffers
+static void client_close(client_t *c) {
+  close(c->fd);
+  free(c->payload);
+  free(c->result);
+  free(c->out);
+  c->fd = -1;
+}
+
+// reads whatever part of the next request has arrived; returns false if
+// the connection was closed or failed
+static bool client_read(client_t *c, latency_t *lat) {
+  while (!c->ready && c->out == NULL) {
+    uint8_t *dst;
+    size_t want;
+    if (c->got < SVC_HEADER) {
+      dst = c->hdr + c->got;
+      want = SVC_HEADER - c->got;
+    } else {
+      dst = c->payload + (c->got - SVC_HEADER);
+      want = SVC_HEADER + svc_length(c->hdr) - c->got;
+    }
+    if (want > 0) {
+      ssize_t n = read(c->fd, dst, want);
+      if (n == 0) {
+        return false;
+      }
+      if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      }
+      c->got += n;
+    }
+    if (c->got == SVC_HEADER && c->payload == NULL) { // header complete
+      uint32_t len = svc_length(c->hdr);
+      if (len > SVC_MAX_PAYLOAD) {
+        if (c->hdr[0] <= SVC_STATS) {
+          lat->requests[c->hdr[0]]++;
+        }
+        c->status = SVC_TOO_LARGE; // the payload is never read, so the
+        c->result = NULL;          // stream cannot be resynchronized
+        c->rlen = 0;
+        c->closing = true;
+        c->start = now_ns();
+        client_reply(c, lat);
+        return true;
+      }
+      c->payload = (uint8_t *)malloc(len > 0 ? len : 1);
+    }
+    if (c->got == SVC_HEADER + svc_length(c->hdr)) { // request complete
+      c->got = 0;
+      c->start = now_ns();
+      if (c->hdr[0] <= SVC_STATS) {
+        lat->requests[c->hdr[0]]++;
+      }
+      if (c->hdr[0] == SVC_STATS) {
+        stats_reply(c, lat);
+      } else {
+        c->ready = true;
+      }
+    }
+  }
+  return true;
+}
+
+// sends whatever part of the reply the socket takes; returns false if the
+// connection failed or should now be closed
+static bool client_flush(client_t *c, latency_t *lat) {
+  while (c->sent < c->outlen) {
+    ssize_t n = send(c->fd, c->out + c->sent, c->outlen - c->sent,
+                     MSG_NOSIGNAL);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    c->sent += n;
+  }
+  if (c->hdr[0] != SVC_STATS) {
+    latency_add(lat, now_ns() - c->start);
+  }
+  free(c->out);
+  c->out = NULL;
+  c->outlen = 0;
+  return !c->closing;
+}
+
+// creates the listening socket at path, readable only by its owner; fails
+// with EADDRINUSE if a running server still answers on path
+static int listen_on(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      close(fd); // a running server answered, leave its socket alone
+      errno = EADDRINUSE;
+      return -1;
+    }
+    close(fd); // a failed connect leaves fd unusable for bind
+    unlink(path); // left behind by a server that did not stop cleanly
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return -1;
+    }
+  }
+  mode_t old = umask(0077);
+  bool ok = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+            listen(fd, SOMAXCONN) == 0;
+  umask(old);
+  if (!ok) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+// accepts every pending connection into a free client slot
+static void accept_clients(int lfd, client_t *clients, uint32_t *nclients) {
+  int fd;
+  while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+    uint32_t i = 0;
+    while (i < *nclients && clients[i].fd >= 0) {
+      i++;
+    }
+    if (i == MAX_CLIENTS) {
+      close(fd); // full, the client sees the connection drop
+      continue;
+    }
+    if (i == *nclients) {
+      (*nclients)++;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    memset(&clients[i], 0, sizeof(client_t));
+    clients[i].fd = fd;
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *path = "rsad.sock";
+  const char *keyfiles[MAX_KEYS];
+  uint32_t nkeys = 0;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t threads = cpus > 0 ? (uint32_t)cpus : 1;
+  bool stats_json = false; // print --stats as JSON instead of text
+  int32_t opt = 0;
+  while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 's':
+      path = optarg;
+      break;
+    case 'n':
+      if (nkeys == MAX_KEYS) {
+        fprintf(stderr, "at most %d keys can be served\n", MAX_KEYS);
+        return 1;
+      }
+      keyfiles[nkeys++] = optarg;
+      break;
+    case 't':
+      threads = strtoul(optarg, NULL, 10); // setting threads to optarg
+      if (threads == 0) {
+        fprintf(stderr, "threads must be at least 1\n");
+        return 1;
+      }
+      break;
+    case OPT_STATS:
+      if (!stats_parse_opt(optarg, &stats_json)) {
+        return 1;
+      }
+      break;
+    case 'h':
+      usage();
+      return 0;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (nkeys == 0) {
+    keyfiles[nkeys++] = "rsa.priv";
+  }
+
+  server_t s;
+  memset(&s, 0, sizeof(s));
+  s.nkeys = nkeys;
+  for (uint32_t i = 0; i < nkeys; i++) {
+    if (!load_key(&s.keys[i], keyfiles[i])) {
+      fprintf(stderr, "%s: missing or malformed private key\n", keyfiles[i]);
+      return 1;
+    }
+  }
+  int lfd = listen_on(path);
+  if (lfd < 0 && errno == EADDRINUSE) {
+    fprintf(stderr, "%s: exists or a running rsad uses it\n", path);
+    return 1;
+  }
+  if (lfd < 0) {
+    fprintf(stderr, "%s: socket couldn't be created\n", path);
+    return 1;
+  }
+  if (!wake_open()) {
+    fprintf(stderr, "signal pipe couldn't be created\n");
+    close(lfd);
+    unlink(path);
+    return 1;
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  pool_t *pool = threads > 1 ? pool_create(threads) : NULL;
+  for (uint32_t i = 0; i < nkeys; i++) { // not per request
+    key_contexts(&s.keys[i], pool != NULL ? pool_threads(pool) : 1);
+  }
+  client_t *clients = (client_t *)calloc(MAX_CLIENTS, sizeof(client_t));
+  struct pollfd *fds =
+      (struct pollfd *)malloc((MAX_CLIENTS + 2) * sizeof(struct pollfd));
+  s.batch = (client_t **)malloc(MAX_CLIENTS * sizeof(client_t *));
+  uint32_t nclients = 0;
+  latency_t lat;
+  memset(&lat, 0, sizeof(lat));
+
+  while (!stopping) {
+    fds[0].fd = lfd;
+    fds[0].events = POLLIN;
+    for (uint32_t i = 0; i < nclients; i++) {
+      client_t *c = &clients[i];
+      fds[i + 1].fd = c->fd; // negative fds are skipped by poll
+      fds[i + 1].events = c->out != NULL ? POLLOUT : POLLIN;
+    }
+    fds[nclients + 1].fd = wake[0]; // readable once a signal arrived
+    fds[nclients + 1].events = POLLIN;
+    if (poll(fds, nclients + 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    for (uint32_t i = 0; i < nclients; i++) {
+      client_t *c = &clients[i];
+      short ev = fds[i + 1].revents;
+      if (c->fd < 0 || ev == 0) {
+        continue;
+      }
+      bool alive = true;
+      if (c->out != NULL) {
+        alive = client_flush(c, &lat);
+      } else if ((ev & (POLLIN | POLLHUP | POLLERR)) != 0) {
+        alive = client_read(c, &lat);
+      }
+      if (alive && c->out != NULL) {
+        alive = client_flush(c, &lat); // stats replies go out right away
+      }
+      if (!alive) {
+        client_close(c);
+      }
+    }
+    if ((fds[0].revents & POLLIN) != 0) {
+      accept_clients(lfd, clients, &nclients);
+    }
+
+    uint64_t count = 0; // every complete request forms one batch
+    for (uint32_t i = 0; i < nclients; i++) {
+      if (clients[i].fd >= 0 && clients[i].ready) {
+        s.batch[count++] = &clients[i];
+      }
+    }
+    if (count == 0) {
+      continue;
+    }
+    if (pool != NULL) {
+      pool_run(pool, batch_job, &s, count);
+    } else {
+      for (uint64_t i = 0; i < count; i++) {
+        batch_job(&s, i, 0);
+      }
+    }
+    lat.batches++;
+    if (count > lat.max_batch) {
+      lat.max_batch = count;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+      client_reply(s.batch[i], &lat);
+      if (!client_flush(s.batch[i], &lat)) {
+        client_close(s.batch[i]);
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < nclients; i++) {
+    if (clients[i].fd >= 0) {
+      client_close(&clients[i]);
+    }
+  }
+  close(lfd);
+  unlink(path);
+  close(wake[0]);
+  close(wake[1]);
+  pool_delete(&pool);
+  if (stats_enabled) {
+    stats_print(stderr, stats_json);
+  }
+  for (uint32_t i = 0; i < nkeys; i++) {
+    free_key(&s.keys[i]);
+  }
+  free(clients);
+  free(fds);
+  free(s.batch);
+  return 0;
+}
@@ -0,0 +1,98 @@
+#include "service.h"
+// clang-format off
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+// clang-format on
+
+static const char *status_names[SVC_STATUSES] = {
+  "ok", "unknown operation", "unknown key", "request too large",
+  "malformed request",
+};
+
+// fills in a request or reply header
+void svc_header(uint8_t h[SVC_HEADER], uint8_t code, uint8_t key,
+                uint32_t len) {
+  h[0] = code;
+  h[1] = key;
+  h[2] = 0;
+  h[3] = 0;
+  for (int i = 0; i < 4; i++) {
+    h[4 + i] = (uint8_t)(len >> (24 - 8 * i)); // big-endian length
+  }
+}
+
+// returns the payload length of a header
+uint32_t svc_length(const uint8_t h[SVC_HEADER]) {
+  return (uint32_t)h[4] << 24 | (uint32_t)h[5] << 16 | (uint32_t)h[6] << 8 |
+         h[7];
+}
+
+// returns a short description of a status
+const char *svc_status_name(svc_status_t s) {
+  return s < SVC_STATUSES ? status_names[s] : "unknown status";
+}
+
+// writes all len bytes of buf to the socket fd
+static bool write_all(int fd, const uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL); // no SIGPIPE if closed
+    if (n <= 0) {
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+// reads exactly len bytes from fd into buf
+static bool read_all(int fd, uint8_t *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+    if (n <= 0) {
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+// sends one request to the rsad socket at path and reads its reply
+bool svc_call(const char *path, svc_op_t op, uint8_t key, const uint8_t *req,
+              uint32_t len, svc_status_t *status, uint8_t **resp,
+              uint32_t *rlen) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return false;
+  }
+  uint8_t h[SVC_HEADER];
+  svc_header(h, op, key, len);
+  bool ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+            write_all(fd, h, SVC_HEADER) && write_all(fd, req, len) &&
+            read_all(fd, h, SVC_HEADER);
+  *resp = NULL;
+  if (ok) {
+    *status = (svc_status_t)h[0];
+    *rlen = svc_length(h);
+    *resp = (uint8_t *)malloc(*rlen > 0 ? *rlen : 1);
+    ok = read_all(fd, *resp, *rlen);
+  }
+  if (!ok) {
+    free(*resp);
+    *resp = NULL;
+  }
+  close(fd);
+  return ok;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+// clang-format off
+#include <stdbool.h>
+#include <stdint.h>
+// clang-format on
+
+//
+// The protocol spoken by rsad over a Unix domain socket. A request is an
+// 8 byte header (the operation, the key number, 2 zero bytes and the 4 byte
+// big-endian payload length) followed by the payload. The reply has the same
+// layout, with a status in place of the operation and a zero key number.
+// A connection may carry any number of requests, answered in order.
+//
+// SVC_DECRYPT: the payload is a ciphertext file in any format encrypt
+//   writes; the reply is the plaintext.
+// SVC_SIGN: the payload is a big-endian message smaller than n; the reply
+//   is its big-endian signature.
+// SVC_STATS: no payload; the reply is a JSON object of request counters
+//   and latencies. The key number is ignored.
+//
+typedef enum {
+  SVC_DECRYPT = 1,
+  SVC_SIGN = 2,
+  SVC_STATS = 3,
+} svc_op_t;
+
+//
+// Statuses of a reply.
+//
+typedef enum {
+  SVC_OK,        // the payload is the result
+  SVC_BAD_OP,    // the operation is unknown
+  SVC_BAD_KEY,   // the server has no key with that number
+  SVC_TOO_LARGE, // the payload exceeds SVC_MAX_PAYLOAD
+  SVC_FAILED,    // the payload is malformed or out of range for the key
+  SVC_STATUSES
+} svc_status_t;
+
+#define SVC_HEADER      8         // bytes in a request or reply header
+#define SVC_MAX_PAYLOAD (1 << 26) // largest request payload accepted
+
+//
+// Fills in a request or reply header.
+//
+// h: the header to fill in.
+// code: the operation or status.
+// key: the key number, 0 in replies.
+// len: the length of the payload that follows.
+//
+void svc_header(uint8_t h[SVC_HEADER], uint8_t code, uint8_t key,
+                uint32_t len);
+
+//
+// Returns the payload length of a header.
+//
+// h: the header.
+//
+uint32_t svc_length(const uint8_t h[SVC_HEADER]);
+
+//
+// Returns a short description of a status.
+//
+// s: the status.
+//
+const char *svc_status_name(svc_status_t s);
+
+//
+// Connects to an rsad socket, sends one request and waits for its reply.
+//
+// path: the path of the socket.
+// op: the operation to request.
+// key: the number of the key to use.
+// req: the request payload.
+// len: bytes in req.
+// status: will store the status of the reply.
+// resp: will store the reply payload, allocated with malloc; the caller
+//       must free it.
+// rlen: will store bytes in resp.
+// returns: true if a reply was received, false if the server could not be
+//          reached or the connection failed.
+//
+bool svc_call(const char *path, svc_op_t op, uint8_t key, const uint8_t *req,
+              uint32_t len, svc_status_t *status, uint8_t **resp,
+              uint32_t *rlen);
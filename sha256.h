@@ -0,0 +1,20 @@
+#pragma once
+
+// clang-format off
+#include <stddef.h>
+#include <stdint.h>
+// clang-format on
+
+#define SHA256_BYTES 32 // bytes in a SHA-256 digest
+
+//
+// Hashes the concatenation of two messages with SHA-256 (FIPS 180-4).
+//
+// out: will store the 32 byte digest.
+// a: the first message.
+// alen: the number of bytes in a.
+// b: the second message, appended to a.
+// blen: the number of bytes in b.
+//
+void sha256_pair(uint8_t out[SHA256_BYTES], const uint8_t *a, size_t alen,
+                 const uint8_t *b, size_t blen);
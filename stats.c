@@ -0,0 +1,80 @@
+#include "stats.h"
+// clang-format off
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+// clang-format on
+
+bool stats_enabled = false;
+atomic_uint_fast64_t stats_counts[STAT_COUNTERS];
+atomic_uint_fast64_t stats_nanos[STAT_PHASES];
+static uint64_t stats_began; // timestamp of stats_enable
+
+static const char *counter_names[STAT_COUNTERS] = {
+  "candidates", "sieved",  "mr_rounds", "pow_mod",
+  "squarings",  "blocks", "bytes_in",  "bytes_out",
+};
+
+static const char *phase_names[STAT_PHASES] = { "io", "math", "parse" };
+
+// returns the monotonic clock in nanoseconds
+static uint64_t nanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// starts collecting statistics
+void stats_enable(void) {
+  stats_began = nanos();
+  stats_enabled = true;
+}
+
+// enables statistics for a --stats option whose argument is arg
+bool stats_parse_opt(const char *arg, bool *json) {
+  if (arg != NULL && strcmp(arg, "json") != 0 && strcmp(arg, "text") != 0) {
+    fprintf(stderr, "--stats must be text or json\n");
+    return false;
+  }
+  *json = arg != NULL && strcmp(arg, "json") == 0;
+  stats_enable();
+  return true;
+}
+
+// returns a timestamp for stats_stop, or 0 if statistics are disabled
+uint64_t stats_start(void) { return stats_enabled ? nanos() : 0; }
+
+// adds the time since start to phase p
+void stats_stop(stat_phase_t p, uint64_t start) {
+  if (stats_enabled) {
+    atomic_fetch_add_explicit(&stats_nanos[p], nanos() - start,
+                              memory_order_relaxed);
+  }
+}
+
+// prints the statistics as JSON or as a summary
+void stats_print(FILE *f, bool json) {
+  double wall = (nanos() - stats_began) / 1e9;
+  if (json) {
+    fprintf(f, "{\"wall_sec\": %.6f", wall);
+    for (int i = 0; i < STAT_PHASES; i++) {
+      fprintf(f, ", \"%s_sec\": %.6f", phase_names[i],
+              atomic_load(&stats_nanos[i]) / 1e9);
+    }
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+      fprintf(f, ", \"%s\": %" PRIu64, counter_names[i],
+              (uint64_t)atomic_load(&stats_counts[i]));
+    }
+    fprintf(f, "}\n");
+    return;
+  }
+  fprintf(f, "%-12s %14.6f s\n", "wall", wall);
+  for (int i = 0; i < STAT_PHASES; i++) {
+    fprintf(f, "%-12s %14.6f s\n", phase_names[i],
+            atomic_load(&stats_nanos[i]) / 1e9);
+  }
+  for (int i = 0; i < STAT_COUNTERS; i++) {
+    fprintf(f, "%-12s %14" PRIu64 "\n", counter_names[i],
+            (uint64_t)atomic_load(&stats_counts[i]));
+  }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+// clang-format off
+#include <stdio.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+// clang-format on
+
+//
+// Counters of the work done by the number theory and file routines.
+//
+typedef enum {
+  STAT_CANDIDATES, // prime candidates drawn or sieved by make_prime
+  STAT_SIEVED,     // candidates rejected by the small prime sieve
+  STAT_MR_ROUNDS,  // Miller-Rabin rounds run
+  STAT_POW_MOD,    // pow_mod calls
+  STAT_SQUARINGS,  // modular squarings done by pow_mod
+  STAT_BLOCKS,     // blocks or chunks encrypted or decrypted
+  STAT_BYTES_IN,   // bytes read from the input file
+  STAT_BYTES_OUT,  // bytes written to the output file
+  STAT_COUNTERS
+} stat_counter_t;
+
+//
+// Phases whose time is accumulated. Time spent by worker threads is summed,
+// so a phase can exceed the wall clock time with more than one thread.
+//
+typedef enum {
+  STAT_IO,    // reading input and writing output
+  STAT_MATH,  // modular arithmetic, prime search and ciphers
+  STAT_PARSE, // converting ciphertext records to numbers
+  STAT_PHASES
+} stat_phase_t;
+
+extern bool stats_enabled;
+extern atomic_uint_fast64_t stats_counts[STAT_COUNTERS];
+extern atomic_uint_fast64_t stats_nanos[STAT_PHASES];
+
+//
+// Starts collecting statistics. Until this is called, counting and timing
+// cost one predictable branch.
+//
+void stats_enable(void);
+
+//
+// Adds v to a counter if statistics are enabled.
+//
+// c: the counter to add to.
+// v: the amount to add.
+//
+static inline void stats_add(stat_counter_t c, uint64_t v) {
+  if (stats_enabled) {
+    atomic_fetch_add_explicit(&stats_counts[c], v, memory_order_relaxed);
+  }
+}
+
+//
+// Handles a --stats[=json|text] option: checks its argument and starts
+// collecting statistics.
+//
+// arg: the option argument, or NULL if there is none.
+// json: will store true if the statistics are to be printed as JSON.
+// returns: false, after printing an error, if arg is not json or text.
+//
+bool stats_parse_opt(const char *arg, bool *json);
+
+//
+// Returns a timestamp in nanoseconds to pass to stats_stop(), or 0 if
+// statistics are disabled.
+//
+uint64_t stats_start(void);
+
+//
+// Adds the time since start to a phase if statistics are enabled.
+//
+// p: the phase the time was spent in.
+// start: the timestamp returned by stats_start().
+//
+void stats_stop(stat_phase_t p, uint64_t start);
+
+//
+// Prints the counters, phase times and wall clock time since
+// stats_enable().
+//
+// f: the file to print to.
+// json: true for a JSON object, false for a human-readable summary.
+//
+void stats_print(FILE *f, bool json);
@@ -0,0 +1,218 @@
+// clang-format off
+#include <stdio.h>
+#include <gmp.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "pool.h"
+#include "rsa.h"
+#include "stats.h"
+// clang-format on
+
+#define OPTIONS "t:vh"
+
+#define OPT_STATS 256 // --stats has no short form
+
+static const struct option long_options[] = {
+  { "stats", optional_argument, NULL, OPT_STATS },
+  { NULL, 0, NULL, 0 },
+};
+
+// outcome of checking one public key file
+typedef enum {
+  KEY_OK,
+  KEY_UNREADABLE,    // the file could not be opened
+  KEY_MALFORMED,     // the file does not hold n, e, signature and username
+  KEY_BAD_SIGNATURE, // the signature does not match the username
+} key_status_t;
+
+static const char *status_names[] = { "ok", "unreadable", "malformed",
+                                      "bad signature" };
+
+// the key files to check and their outcomes
+typedef struct {
+  char **paths;
+  key_status_t *status;
+  uint64_t count;
+  uint64_t cap;
+} audit_t;
+
+// prints the program synopsis and usage
+static void usage(void) {
+  fprintf(stderr, "Usage: ./verify [options] <pbfile|directory>...\n");
+  fprintf(stderr, "  ./verify checks the username signature of every given "
+                  "public key file,\n");
+  fprintf(stderr, "  and of every .pub file in the given directories, and "
+                  "lists the failures.\n");
+  fprintf(stderr, "    -t <threads>: Verify with <threads> worker threads. "
+                  "Default: online CPUs\n");
+  fprintf(stderr, "    -v          : List keys that pass as well.\n");
+  fprintf(stderr, "    --stats[=json]: Print counters and timings to "
+                  "stderr when done.\n");
+  fprintf(stderr, "    -h          : Display program synopsis and usage.\n");
+}
+
+// appends a copy of path to the audit
+static void audit_add(audit_t *a, const char *path) {
+  if (a->count == a->cap) {
+    a->cap = a->cap > 0 ? 2 * a->cap : 64;
+    a->paths = (char **)realloc(a->paths, a->cap * sizeof(char *));
+  }
+  a->paths[a->count++] = strdup(path);
+}
+
+// compares two paths for qsort
+static int cmp_path(const void *x, const void *y) {
+  return strcmp(*(char *const *)x, *(char *const *)y);
+}
+
+// adds every .pub file directly inside dir, in name order; returns false if
+// dir cannot be read
+static bool audit_add_dir(audit_t *a, const char *dir) {
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    return false;
+  }
+  uint64_t first = a->count;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    size_t len = strlen(ent->d_name);
+    if (len <= 4 || strcmp(ent->d_name + len - 4, ".pub") != 0) {
+      continue;
+    }
+    char *path = (char *)malloc(strlen(dir) + len + 2);
+    sprintf(path, "%s/%s", dir, ent->d_name);
+    audit_add(a, path);
+    free(path);
+  }
+  closedir(d);
+  qsort(a->paths + first, a->count - first, sizeof(char *), cmp_path);
+  return true;
+}
+
+// reads one public key file and verifies its username signature
+static key_status_t verify_key(const char *path) {
+  uint64_t start = stats_start();
+  FILE *pbfile = fopen(path, "r");
+  struct stat st;
+  if (pbfile == NULL || fstat(fileno(pbfile), &st) != 0) {
+    if (pbfile != NULL) {
+      fclose(pbfile);
+    }
+    return KEY_UNREADABLE;
+  }
+  char *username = (char *)malloc(st.st_size + 1); // can't outgrow the file
+  mpz_t n, e, s, user;
+  mpz_inits(n, e, s, user, NULL);
+  bool read = rsa_read_pub(n, e, s, username, pbfile);
+  fclose(pbfile);
+  stats_add(STAT_BYTES_IN, st.st_size);
+  stats_stop(STAT_IO, start);
+
+  key_status_t status = KEY_MALFORMED;
+  if (read && mpz_sgn(n) > 0) {
+    start = stats_start();
+    status = mpz_set_str(user, username, 62) == 0 && rsa_verify(user, s, e, n)
+                 ? KEY_OK
+                 : KEY_BAD_SIGNATURE;
+    stats_stop(STAT_MATH, start);
+  }
+  stats_add(STAT_BLOCKS, 1);
+  mpz_clears(n, e, s, user, NULL);
+  free(username);
+  return status;
+}
+
+// checks key i of an audit_t (run on a pool worker)
+static void verify_job(void *arg, uint64_t i, uint32_t worker) {
+  (void)worker;
+  audit_t *a = (audit_t *)arg;
+  a->status[i] = verify_key(a->paths[i]);
+}
+
+int main(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t threads = cpus > 0 ? (uint32_t)cpus : 1;
+  bool verbose = false;
+  bool stats_json = false; // print --stats as JSON instead of text
+  int32_t opt = 0;
+  while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 't':
+      threads = strtoul(optarg, NULL, 10); // setting threads to optarg
+      if (threads == 0) {
+        fprintf(stderr, "threads must be at least 1\n");
+        return 1;
+      }
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case OPT_STATS:
+      if (!stats_parse_opt(optarg, &stats_json)) {
+        return 1;
+      }
+      break;
+    case 'h':
+      usage();
+      return 0;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (optind == argc) {
+    usage();
+    return 1;
+  }
+
+  audit_t a = { NULL, NULL, 0, 0 };
+  uint64_t failed = 0;
+  for (int i = optind; i < argc; i++) {
+    struct stat st;
+    if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+      if (!audit_add_dir(&a, argv[i])) {
+        fprintf(stderr, "%s: directory couldn't be read\n", argv[i]);
+        failed++;
+      }
+    } else {
+      audit_add(&a, argv[i]); // missing files are reported as unreadable
+    }
+  }
+  a.status = (key_status_t *)malloc((a.count + 1) * sizeof(key_status_t));
+
+  pool_t *pool = threads > 1 ? pool_create(threads) : NULL;
+  if (pool != NULL) {
+    pool_run(pool, verify_job, &a, a.count);
+    pool_delete(&pool);
+  } else {
+    for (uint64_t i = 0; i < a.count; i++) {
+      verify_job(&a, i, 0);
+    }
+  }
+
+  for (uint64_t i = 0; i < a.count; i++) { // report in input order
+    if (a.status[i] != KEY_OK) {
+      failed++;
+    }
+    if (a.status[i] != KEY_OK || verbose) {
+      printf("%s: %s\n", a.paths[i], status_names[a.status[i]]);
+    }
+    free(a.paths[i]);
+  }
+  fprintf(stderr, "%" PRIu64 " keys checked, %" PRIu64 " failed\n", a.count,
+          failed);
+  if (stats_enabled) {
+    stats_print(stderr, stats_json);
+  }
+  free(a.paths);
+  free(a.status);
+  return failed > 0 ? 1 : 0;
+}